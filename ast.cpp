@@ -0,0 +1,175 @@
+#include "ast.hpp"
+
+// system includes
+#include <algorithm>
+#include <cstring>
+
+// special form names, interned once
+static const Symbol SYM_BEGIN("begin");
+static const Symbol SYM_DEFINE("define");
+static const Symbol SYM_IF("if");
+static const Symbol SYM_AND("and");
+static const Symbol SYM_OR("or");
+static const Symbol SYM_LAMBDA("lambda");
+static const Symbol SYM_WHILE("while");
+static const Symbol SYM_SET("set!");
+
+Opcode opcode_of(const Atom & atom) noexcept{
+  switch (atom.type)
+  {
+  case SymbolType:
+    if (atom.value.sym_value == SYM_AND) return OpAnd;
+    if (atom.value.sym_value == SYM_OR) return OpOr;
+    return OpSymbol;
+  case KeywordType:
+    if (atom.value.sym_value == SYM_BEGIN) return OpBegin;
+    if (atom.value.sym_value == SYM_DEFINE) return OpDefine;
+    if (atom.value.sym_value == SYM_IF) return OpIf;
+    if (atom.value.sym_value == SYM_LAMBDA) return OpLambda;
+    if (atom.value.sym_value == SYM_WHILE) return OpWhile;
+    if (atom.value.sym_value == SYM_SET) return OpSet;
+    return OpKeyword;
+  default:
+    return OpValue;
+  }
+}
+
+namespace {
+
+std::uint64_t atom_bits(const Atom & atom) noexcept{
+  switch (atom.type)
+  {
+  case BooleanType:
+    return atom.value.bool_value;
+  case NumberType:
+    return static_cast<std::uint64_t>(atom.value.num_value);
+  case RealType: {
+    std::uint64_t bits;
+    std::memcpy(&bits, &atom.value.real_value, sizeof(bits));
+    return bits;
+  }
+  case SymbolType:
+  case KeywordType:
+    return atom.value.sym_value.index();
+  case LambdaType:
+    return reinterpret_cast<std::uintptr_t>(atom.value.closure_value);
+  default:
+    return 0;
+  }
+}
+
+std::size_t mix(std::size_t h, std::uint64_t x) noexcept{
+  return (h ^ x) * 0x100000001B3u + (h >> 29);
+}
+
+std::size_t hash_block(const Node * block, std::size_t count) noexcept{
+  std::size_t h = count;
+  for (std::size_t i = 0; i < count; i++) {
+    const Node & n = block[i];
+    h = mix(h, n.head.type | (std::uint64_t(n.op) << 8));
+    h = mix(h, atom_bits(n.head));
+    h = mix(h, n.first | (std::uint64_t(n.count) << 32));
+    h = mix(h, n.depth | (std::uint64_t(n.slot) << 16));
+  }
+  return h;
+}
+
+} // namespace
+
+bool operator==(const Node & a, const Node & b) noexcept{
+  return a.head.type == b.head.type && a.op == b.op
+    && a.first == b.first && a.count == b.count
+    && a.depth == b.depth && a.slot == b.slot
+    && atom_bits(a.head) == atom_bits(b.head);
+}
+
+void Ast::reserve(std::size_t count){
+  nodes.reserve(count);
+}
+
+void Ast::shrink_to_fit(){
+  nodes.shrink_to_fit();
+  std::unordered_multimap<std::size_t, Block>().swap(blocks);
+}
+
+void Ast::compact(){
+  std::vector<Node> kept;
+  kept.reserve(nodes.size());
+  // where each block already kept went, by its old first and count.
+  // Without hash consing every block has a single parent.
+  std::unordered_map<std::uint64_t, Index> moved;
+  auto keep = [&](Index first, std::uint32_t count) -> Index {
+    if (count == 0) return first;
+    std::uint64_t key = first | (std::uint64_t(count) << 32);
+    if (hash_cons) {
+      auto it = moved.find(key);
+      if (it != moved.end()) return it->second;
+    }
+    Index to = static_cast<Index>(kept.size());
+    kept.insert(kept.end(), nodes.begin() + first, nodes.begin() + first + count);
+    if (hash_cons) moved.emplace(key, to);
+    return to;
+  };
+
+  // kept is its own work queue: the tail of each kept node is copied
+  // after it, and then visited in turn
+  Node root = nodes.back();
+  root.first = keep(root.first, root.count);
+  for (std::size_t i = 0; i < kept.size(); i++) {
+    Index first = keep(kept[i].first, kept[i].count);
+    kept[i].first = first;
+  }
+  kept.push_back(root);
+
+  kept.shrink_to_fit();
+  nodes.swap(kept);
+  std::unordered_multimap<std::size_t, Block>().swap(blocks);
+}
+
+Ast::Index Ast::append(const Node * block, std::size_t count){
+  std::size_t h = 0;
+  if (hash_cons && count > 0) {
+    h = hash_block(block, count);
+    auto range = blocks.equal_range(h);
+    for (auto it = range.first; it != range.second; ++it) {
+      const Block & b = it->second;
+      if (b.count == count && std::equal(block, block + count, nodes.begin() + b.first)) {
+        return b.first;
+      }
+    }
+  }
+  Index first = static_cast<Index>(nodes.size());
+  nodes.insert(nodes.end(), block, block + count);
+  if (hash_cons && count > 0) {
+    blocks.emplace(h, Block{first, static_cast<std::uint32_t>(count)});
+  }
+  return first;
+}
+
+Expression Ast::to_expression(Index i) const{
+  const Node & node = nodes[i];
+  Expression exp(node.head);
+  exp.tail.reserve(node.count);
+  for (Index c = node.first; c < node.first + node.count; c++) {
+    exp.tail.push_back(to_expression(c));
+  }
+  return exp;
+}
+
+int lambda_arity(const Ast & ast, const Node & params) noexcept{
+  if (params.head.type != SymbolType) return -1;
+  for (std::uint32_t i = 0; i < params.count; i++) {
+    const Node & p = ast[params.first + i];
+    if (p.head.type != SymbolType || p.count != 0) return -1;
+  }
+  for (std::uint32_t i = 1; i <= params.count; i++) {
+    for (std::uint32_t j = 0; j < i; j++) {
+      if (lambda_param(ast, params, i) == lambda_param(ast, params, j)) return -1;
+    }
+  }
+  return static_cast<int>(params.count + 1);
+}
+
+Symbol lambda_param(const Ast & ast, const Node & params, std::uint32_t i) noexcept{
+  return i == 0 ? params.head.value.sym_value : ast[params.first + i - 1].head.value.sym_value;
+}
@@ -0,0 +1,114 @@
+#ifndef AST_HPP
+#define AST_HPP
+
+// system includes
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// module includes
+#include "expression.hpp"
+
+// An Opcode says how a node evaluates, resolved once at parse time
+// so the evaluator dispatches with a switch instead of comparing names.
+// and/or are builtins that cannot be redefined, so they get opcodes
+// of their own to evaluate their arguments lazily. OpLocal is a symbol
+// the parser resolved to a lambda parameter.
+enum Opcode : unsigned char {OpValue, OpSymbol, OpBegin, OpDefine, OpIf, OpKeyword, OpAnd, OpOr,
+                             OpLambda, OpLocal, OpWhile, OpSet};
+
+// the opcode for a node whose head is atom
+Opcode opcode_of(const Atom & atom) noexcept;
+
+// A Node is one expression of a parsed program: its head atom,
+// the index range [first, first + count) of its tail, and its opcode.
+// An OpLocal node names parameter slot of the lambda depth levels out,
+// 0 being the innermost.
+struct Node{
+  Atom head;
+  std::uint32_t first = 0;
+  std::uint32_t count = 0;
+  Opcode op = OpValue;
+  std::uint16_t depth = 0;
+  std::uint16_t slot = 0;
+};
+
+// nodes are equal when their heads, opcodes, addresses and tail blocks are;
+// numbers compare by kind and bit pattern
+bool operator==(const Node & a, const Node & b) noexcept;
+inline bool operator!=(const Node & a, const Node & b) noexcept { return !(a == b); }
+
+// An Ast is a parsed program stored flat in a single arena.
+// The tail of every node is a contiguous block of nodes, and the
+// root is the last node. Nodes refer to each other by index, so the
+// whole program is one allocation and is freed at once.
+//
+// With hash consing on, append stores each distinct block once and
+// hands back the existing copy for a repeat. Blocks are appended
+// bottom up, so equal subtrees end up with equal nodes and the same
+// tail index, and the program becomes a DAG of shared subtrees.
+class Ast{
+public:
+  typedef std::uint32_t Index;
+
+  explicit Ast(bool hash_cons = false): hash_cons(hash_cons) {};
+
+  std::size_t size() const noexcept { return nodes.size(); }
+
+  bool empty() const noexcept { return nodes.empty(); }
+  Index root() const noexcept { return static_cast<Index>(nodes.size() - 1); }
+
+  const Node & operator[](Index i) const noexcept { return nodes[i]; }
+  Node & operator[](Index i) noexcept { return nodes[i]; }
+
+  // size the arena for a program with this many nodes
+  void reserve(std::size_t count);
+
+  // append a block of sibling nodes, return the index of the first one
+  Index append(const Node * block, std::size_t count);
+
+  // append the root node, never shared so that it is the last node
+  void set_root(const Node & root) { nodes.push_back(root); }
+
+  // release spare arena capacity and the hash consing table once the
+  // program is complete; later appends no longer share with earlier ones
+  void shrink_to_fit();
+
+  // keep only the nodes the root reaches, in an arena of exactly their
+  // size, dropping blocks that were replaced after they were appended.
+  // Shared blocks stay shared. Like shrink_to_fit, the hash consing
+  // table is released.
+  void compact();
+
+  void clear() noexcept { nodes.clear(); blocks.clear(); }
+  void swap(Ast & other) noexcept {
+    nodes.swap(other.nodes);
+    blocks.swap(other.blocks);
+    std::swap(hash_cons, other.hash_cons);
+  }
+
+  // rebuild the subtree at i as an Expression
+  Expression to_expression(Index i) const;
+
+private:
+  struct Block{
+    Index first;
+    std::uint32_t count;
+  };
+
+  std::vector<Node> nodes;
+  bool hash_cons;
+  // blocks appended so far by structural hash, when hash consing
+  std::unordered_multimap<std::size_t, Block> blocks;
+};
+
+// the number of parameters in the parameter list of a lambda, or -1
+// if it is not a list of distinct symbols. (x y z) is a node with head
+// x and tail y z, so parameter 0 is the head.
+int lambda_arity(const Ast & ast, const Node & params) noexcept;
+
+// the name of parameter i of a well-formed parameter list
+Symbol lambda_param(const Ast & ast, const Node & params, std::uint32_t i) noexcept;
+
+#endif
@@ -0,0 +1,70 @@
+// AST memory benchmark
+//   usage: bench_ast [forms]
+// parses a large generated program and reports the heap held by its AST,
+// as parsed and with hash consing
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+
+#include "ast.hpp"
+#include "expression.hpp"
+#include "interpreter.hpp"
+
+// live heap bytes, tracked through a size header on every allocation
+static std::size_t live_bytes = 0;
+
+void * operator new(std::size_t size){
+  void * p = std::malloc(size + 16);
+  if (!p) throw std::bad_alloc();
+  *static_cast<std::size_t *>(p) = size;
+  live_bytes += size;
+  return static_cast<char *>(p) + 16;
+}
+
+void operator delete(void * p) noexcept{
+  if (!p) return;
+  char * base = static_cast<char *>(p) - 16;
+  live_bytes -= *reinterpret_cast<std::size_t *>(base);
+  std::free(base);
+}
+
+void operator delete(void * p, std::size_t) noexcept{
+  operator delete(p);
+}
+
+int main(int argc, char ** argv){
+  std::size_t forms = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 200000;
+
+  // (begin (define v0 (+ (* 1.5 2) (- 3 v) (< 1 2))) ...)
+  std::string src = "(begin";
+  for (std::size_t i = 0; i < forms; i++) {
+    src += " (define v" + std::to_string(i) + " (+ (* 1.5 2) (- 3 4) (pow 2 (log10 100))))";
+  }
+  src += ")";
+
+  std::cout << "sizeof(Atom)       " << sizeof(Atom) << std::endl
+            << "sizeof(Expression) " << sizeof(Expression) << std::endl
+            << "sizeof(Node)       " << sizeof(Node) << std::endl
+            << "source bytes       " << src.size() << std::endl;
+
+  bool ok = true;
+  for (bool hash_cons : {false, true}) {
+    std::size_t before = live_bytes;
+    auto t0 = std::chrono::steady_clock::now();
+    Interpreter * interp = new Interpreter;
+    interp->set_hash_consing(hash_cons);
+    ok &= interp->parse(std::string_view(src));
+    auto t1 = std::chrono::steady_clock::now();
+    std::size_t held = live_bytes - before;
+
+    std::cout << (hash_cons ? "hash consed" : "plain") << std::endl
+              << "  AST heap bytes   " << held << std::endl
+              << "  parse time       "
+              << std::chrono::duration<double, std::milli>(t1 - t0).count() << " ms" << std::endl;
+    delete interp;
+  }
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,65 @@
+// Environment scaling benchmark
+//   usage: bench_env [max-defines]
+// times define and lookup per operation as the number of bindings
+// grows from 10 to max-defines, against a std::map of the same bindings
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "environment.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+// keeps the lookup loops from being optimized away
+static volatile std::size_t sink;
+
+static double ns_per_op(Clock::time_point t0, Clock::time_point t1, std::size_t ops){
+  return std::chrono::duration<double, std::nano>(t1 - t0).count() / ops;
+}
+
+int main(int argc, char ** argv){
+  std::size_t max_defines = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+
+  // intern every name up front so only the environment is timed
+  std::vector<Symbol> syms;
+  for (std::size_t i = 0; i < max_defines; i++) syms.push_back(Symbol("bench-sym-" + std::to_string(i)));
+  std::vector<Symbol> order(syms);
+  std::shuffle(order.begin(), order.end(), std::mt19937(7));
+
+  std::cout << std::setw(9) << "defines"
+            << std::setw(14) << "define ns" << std::setw(14) << "lookup ns"
+            << std::setw(14) << "map define" << std::setw(14) << "map lookup" << std::endl;
+  std::cout << std::fixed << std::setprecision(1);
+
+  for (std::size_t n = 10; n <= max_defines; n *= 10) {
+    const std::size_t lookups = std::max<std::size_t>(n, 1000000);
+    std::size_t found = 0;
+
+    Environment env;
+    auto t0 = Clock::now();
+    for (std::size_t i = 0; i < n; i++) env.define(syms[i], Expression(1.));
+    auto t1 = Clock::now();
+    for (std::size_t i = 0; i < lookups; i++) found += env.find(order[i % n]) != nullptr;
+    auto t2 = Clock::now();
+
+    std::map<Symbol, EnvResult> map;
+    auto t3 = Clock::now();
+    for (std::size_t i = 0; i < n; i++) map.emplace(syms[i], EnvResult{ExpressionType, Expression(1.), nullptr});
+    auto t4 = Clock::now();
+    for (std::size_t i = 0; i < lookups; i++) found += map.find(order[i % n]) != map.end();
+    auto t5 = Clock::now();
+
+    std::cout << std::setw(9) << n
+              << std::setw(14) << ns_per_op(t0, t1, n) << std::setw(14) << ns_per_op(t1, t2, lookups)
+              << std::setw(14) << ns_per_op(t3, t4, n) << std::setw(14) << ns_per_op(t4, t5, lookups)
+              << std::endl;
+    sink += found;
+  }
+  return EXIT_SUCCESS;
+}
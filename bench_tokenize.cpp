@@ -0,0 +1,121 @@
+// Tokenizer throughput benchmark
+//   usage: bench_tokenize [megabytes]
+// compares the per-byte loop tokenize_view replaced against each
+// delimiter scanner mode on a large generated program
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <string_view>
+
+#include "tokenize.hpp"
+
+// scale stretches symbol names and comments, the part the scanners skip
+static std::string make_program(std::size_t bytes, int scale){
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<int> len(4 * scale, 48 * scale);
+  std::uniform_int_distribution<int> pick(0, 9);
+  const char alpha[] = "abcdefghijklmnopqrstuvwxyz-_*+<>=!?";
+
+  std::string src = "(begin\n";
+  while (src.size() < bytes) {
+    switch (pick(rng)) {
+    case 0: // comment line
+      src += "  ; ";
+      src.append(len(rng) * 2, 'c');
+      src += '\n';
+      break;
+    case 1:
+      src += "  (define ";
+      for (int n = len(rng); n > 0; n--) src += alpha[n % (sizeof(alpha) - 1)];
+      src += " 1234.5678)\n";
+      break;
+    default:
+      src += "  (+ ";
+      for (int n = len(rng); n > 0; n--) src += alpha[(n * 7) % (sizeof(alpha) - 1)];
+      src += " (* 3 ";
+      for (int n = len(rng); n > 0; n--) src += alpha[(n * 3) % (sizeof(alpha) - 1)];
+      src += "))\n";
+    }
+  }
+  src += ")\n";
+  return src;
+}
+
+// the byte-at-a-time switch loop the scanners replaced
+static TokenViewSequenceType legacy_tokenize(std::string_view src){
+  TokenViewSequenceType tokens;
+  std::size_t start = 0;
+  bool on_atom = false;
+  auto commit = [&](std::size_t i) {
+    if (on_atom) {
+      tokens.push_back({start, i - start});
+      on_atom = false;
+    }
+  };
+  for (std::size_t i = 0; i < src.size(); i++) {
+    switch (src[i]) {
+    case OPEN:
+    case CLOSE:
+      commit(i);
+      tokens.push_back({i, 1});
+      break;
+    case COMMENT:
+      commit(i);
+      while (i < src.size() && src[i] != '\n') i++;
+      break;
+    case ' ': case '\t': case '\r': case '\n':
+      commit(i);
+      break;
+    default:
+      if (!on_atom) {
+        start = i;
+        on_atom = true;
+      }
+    }
+  }
+  commit(src.size());
+  return tokens;
+}
+
+template <typename F>
+static void run(const char * name, std::string_view src, F tokenize_fn){
+  const int reps = 5;
+  double best = 1e30;
+  std::size_t count = 0;
+  for (int r = 0; r < reps; r++) {
+    auto t0 = std::chrono::steady_clock::now();
+    count = tokenize_fn(src).size();
+    auto t1 = std::chrono::steady_clock::now();
+    best = std::min(best, std::chrono::duration<double>(t1 - t0).count());
+  }
+  double mb = src.size() / (1024.0 * 1024.0);
+  std::cout << std::left << std::setw(10) << name
+            << std::right << std::setw(10) << std::fixed << std::setprecision(1)
+            << mb / best << " MB/s  "
+            << count << " tokens" << std::endl;
+}
+
+int main(int argc, char ** argv){
+  std::size_t mb = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 64;
+  const struct { const char * name; ScanMode mode; } modes[] = {
+    {"scalar", ScanScalar}, {"sse2", ScanSSE2}, {"avx2", ScanAVX2}
+  };
+
+  for (int scale : {1, 8}) {
+    std::string src = make_program(mb * 1024 * 1024, scale);
+    std::cout << "input: " << src.size() << " bytes, atom scale " << scale << std::endl;
+
+    run("legacy", src, legacy_tokenize);
+    for (auto m : modes) {
+      if (!scan_mode_supported(m.mode)) {
+        std::cout << m.name << ": not supported" << std::endl;
+        continue;
+      }
+      run(m.name, src, [&](std::string_view s) { return tokenize_view(s, m.mode); });
+    }
+  }
+  return EXIT_SUCCESS;
+}
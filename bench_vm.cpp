@@ -0,0 +1,84 @@
+// Tree walker vs bytecode VM benchmark
+//   usage: bench_vm [forms] [tree|vm]
+// times Interpreter::eval with each engine on generated arithmetic-
+// and branch-heavy programs and on loops of as many iterations, one
+// of them in a fork that sees its globals through layers of snapshots;
+// the VM compiles once, during parse. Naming an engine runs only that
+// one, for profiling it with perf_dispatch.sh.
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "interpreter.hpp"
+
+static std::string repeat(const std::string & form, std::size_t n){
+  std::string src = "(begin";
+  for (std::size_t i = 0; i < n; i++) src += " " + form;
+  return src + ")";
+}
+
+static double time_eval(Engine engine, const std::string & program, bool forked){
+  Interpreter base(engine);
+  base.parse(std::string_view(
+    "(begin (define a 3) (define b 7) (define i 0) (define step 1)"
+    " (define count (lambda (n) (if (= n 0) n (count (- n 1))))))"));
+  base.eval();
+  std::unique_ptr<Interpreter> fork;
+  if (forked) {
+    for (int layer = 0; layer < 8; layer++) {
+      base.parse(std::string_view("(define layer" + std::to_string(layer) + " 0)"));
+      base.eval();
+      base.snapshot();
+    }
+    fork = std::make_unique<Interpreter>(base.snapshot(), engine);
+  }
+  Interpreter & interp = fork ? *fork : base;
+  if (!interp.parse(std::string_view(program))) std::exit(EXIT_FAILURE);
+
+  double best = 1e30;
+  for (int r = 0; r < 5; r++) {
+    auto t0 = std::chrono::steady_clock::now();
+    interp.eval();
+    auto t1 = std::chrono::steady_clock::now();
+    best = std::min(best, std::chrono::duration<double, std::milli>(t1 - t0).count());
+  }
+  return best;
+}
+
+int main(int argc, char ** argv){
+  std::size_t forms = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100000;
+  std::string_view only = argc > 2 ? argv[2] : "";
+  std::string n = std::to_string(forms);
+
+  std::string globals = "(begin (set! i 0) (while (< i " + n + ") (set! i (+ i step (* 0 pi a b)))) i)";
+  const struct { const char * name; std::string program; bool forked; } workloads[] = {
+    {"arithmetic", repeat("(+ (* a 2.5) (- b 4) (/ (pow a 2) b) (* (+ 1 2) (- 3 4)))", forms), false},
+    {"branches", repeat("(if (< a b) (if (> a 0) (if (= a 3) a b) b) (if (<= b 1) a (- b)))", forms), false},
+    {"while", "(begin (set! i 0) (while (< i " + n + ") (set! i (+ i 1))) i)", false},
+    {"tail calls", "(count " + n + ")", false},
+    {"globals", globals, false},
+    {"forked", globals, true},
+  };
+
+  std::cout << std::fixed << std::setprecision(2);
+  for (const auto & w : workloads) {
+    double tree = 0, vm = 0;
+    std::cout << std::left << std::setw(12) << w.name << std::right;
+    if (only.empty() || only == "tree") {
+      tree = time_eval(TreeEngine, w.program, w.forked);
+      std::cout << "tree " << std::setw(9) << tree << " ms   ";
+    }
+    if (only.empty() || only == "vm") {
+      vm = time_eval(BytecodeEngine, w.program, w.forked);
+      std::cout << "vm " << std::setw(9) << vm << " ms   ";
+    }
+    if (only.empty()) std::cout << "speedup " << tree / vm << "x";
+    std::cout << std::endl;
+  }
+  return EXIT_SUCCESS;
+}
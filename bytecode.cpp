@@ -0,0 +1,273 @@
+#include "bytecode.hpp"
+
+// system includes
+#include <utility>
+#include <vector>
+
+namespace {
+
+class Compiler{
+public:
+  Compiler(const Ast & ast, Chunk & chunk): ast(ast), chunk(chunk) {};
+
+  // compile the node at index with an explicit stack of the nodes being
+  // compiled, so nesting depth costs heap rather than native stack
+  void compile(Ast::Index index);
+
+  std::uint32_t emit(VmOp op, std::uint32_t a = 0, std::uint32_t b = 0){
+    chunk.code.push_back({op, a, b});
+    return static_cast<std::uint32_t>(chunk.code.size() - 1);
+  }
+
+  std::uint32_t here() const{
+    return static_cast<std::uint32_t>(chunk.code.size());
+  }
+
+private:
+  // A Work is a node being compiled. tail is whether its value is the
+  // value of the lambda body it is in, so that a call there can replace
+  // the caller's frame.
+  struct Work{
+    Ast::Index index;
+    bool tail;
+    // how many children have been compiled
+    std::uint32_t done;
+    // an instruction to patch once its target is known, or for and/or
+    // where the node's exits start in exits
+    std::uint32_t mark;
+    // the start of a while loop
+    std::uint32_t loop;
+  };
+
+  // emit the code of work up to its next child, false once it is done
+  bool step(Work & work, Ast::Index & child, bool & child_tail);
+
+  template <typename T>
+  static std::uint32_t add(std::vector<T> & pool, T item){
+    pool.push_back(std::move(item));
+    return static_cast<std::uint32_t>(pool.size() - 1);
+  }
+
+  void emit_throw(const std::string & message){
+    emit(VmThrow, add(chunk.errors, message));
+  }
+
+  const Ast & ast;
+  Chunk & chunk;
+  // jumps out of the and/or nodes being compiled
+  std::vector<std::uint32_t> exits;
+};
+
+void Compiler::compile(Ast::Index index){
+  std::vector<Work> stack;
+  stack.push_back({index, false, 0, 0, 0});
+  while (!stack.empty()) {
+    Ast::Index child;
+    bool child_tail = false;
+    if (step(stack.back(), child, child_tail)) {
+      stack.push_back({child, child_tail, 0, 0, 0});
+    } else {
+      stack.pop_back();
+    }
+  }
+}
+
+bool Compiler::step(Work & work, Ast::Index & child, bool & child_tail){
+  const Node & exp = ast[work.index];
+  std::uint32_t done = work.done++;
+  switch (exp.op)
+  {
+  case OpBegin:
+    if (exp.count == 0) {
+      emit(VmPush, add(chunk.constants, Atom()));
+      return false;
+    }
+    if (done == exp.count) return false;
+    if (done > 0) emit(VmPop);
+    child = exp.first + done;
+    child_tail = work.tail && done + 1 == exp.count;
+    return true;
+
+  case OpDefine: {
+    if (done == 0) {
+      if (exp.count != 2) {
+        emit_throw("incorrect define");
+        return false;
+      }
+      if (ast[exp.first].head.type != SymbolType) {
+        emit_throw("incorrect define symbol");
+        return false;
+      }
+      child = exp.first + 1;
+      return true;
+    }
+    emit(VmDefine, add(chunk.symbols, ast[exp.first].head.value.sym_value));
+    return false;
+  }
+
+  case OpIf:
+    switch (done)
+    {
+    case 0:
+      if (exp.count != 3) {
+        emit_throw("incorrect if");
+        return false;
+      }
+      child = exp.first;
+      return true;
+    case 1:
+      work.mark = emit(VmJumpIfFalse);
+      child = exp.first + 1;
+      child_tail = work.tail;
+      return true;
+    case 2: {
+      std::uint32_t to_end = emit(VmJump);
+      chunk.code[work.mark].a = here();
+      work.mark = to_end;
+      child = exp.first + 2;
+      child_tail = work.tail;
+      return true;
+    }
+    default:
+      chunk.code[work.mark].a = here();
+      return false;
+    }
+
+  case OpKeyword:
+    emit_throw("unexpected keyword");
+    return false;
+
+  case OpWhile:
+    if (done == 0) {
+      if (exp.count < 1) {
+        emit_throw("incorrect while");
+        return false;
+      }
+      work.loop = here();
+      child = exp.first;
+      return true;
+    }
+    // the condition, then each form of the body, has been compiled
+    if (done == 1) {
+      work.mark = emit(VmJumpIfFalse);
+    } else {
+      emit(VmPop);
+    }
+    if (done < exp.count) {
+      child = exp.first + done;
+      return true;
+    }
+    emit(VmJump, work.loop);
+    chunk.code[work.mark].a = here();
+    emit(VmPush, add(chunk.constants, Atom()));
+    return false;
+
+  case OpSet: {
+    if (done == 0) {
+      if (exp.count != 2) {
+        emit_throw("incorrect set!");
+        return false;
+      }
+      if (ast[exp.first].head.type != SymbolType) {
+        emit_throw("incorrect set! symbol");
+        return false;
+      }
+      child = exp.first + 1;
+      return true;
+    }
+    const Node & sym = ast[exp.first];
+    if (sym.op == OpLocal) {
+      emit(VmSetLocal, (std::uint32_t(sym.depth) << 16) | sym.slot);
+    } else {
+      emit(VmSet, add(chunk.symbols, sym.head.value.sym_value));
+    }
+    return false;
+  }
+
+  case OpAnd:
+  case OpOr: {
+    // the first argument equal to decides ends the evaluation
+    std::uint32_t decides = exp.op == OpOr;
+    if (done == 0) {
+      work.mark = static_cast<std::uint32_t>(exits.size());
+    } else {
+      exits.push_back(emit(VmJumpIfEqual, 0, decides));
+    }
+    if (done < exp.count) {
+      child = exp.first + done;
+      return true;
+    }
+    emit(VmPush, add(chunk.constants, Atom(Boolean(!decides))));
+    for (std::size_t e = work.mark; e < exits.size(); e++) chunk.code[exits[e]].a = here();
+    exits.resize(work.mark);
+    return false;
+  }
+
+  case OpLambda: {
+    if (done == 0) {
+      if (exp.count != 2) {
+        emit_throw("incorrect lambda");
+        return false;
+      }
+      int arity = lambda_arity(ast, ast[exp.first]);
+      if (arity < 0) {
+        emit_throw("incorrect lambda parameters");
+        return false;
+      }
+      emit(VmClosure, work.index, static_cast<std::uint32_t>(arity));
+      // the body is compiled in line and jumped over, once per node
+      if (chunk.entries.count(work.index)) return false;
+      work.mark = emit(VmJump);
+      chunk.entries[work.index] = here();
+      child = exp.first + 1;
+      child_tail = true;
+      return true;
+    }
+    emit(VmReturn);
+    chunk.code[work.mark].a = here();
+    return false;
+  }
+
+  case OpLocal:
+  case OpSymbol:
+    if (done == 0) {
+      if (exp.op == OpLocal) {
+        work.mark = emit(VmLocal, (std::uint32_t(exp.depth) << 16) | exp.slot);
+      } else {
+        // arguments only run if the symbol turns out to be a procedure
+        work.mark = emit(VmLookup, add(chunk.symbols, exp.head.value.sym_value));
+      }
+    }
+    if (done < exp.count) {
+      child = exp.first + done;
+      return true;
+    }
+    emit(work.tail ? VmTailCall : VmCall, exp.count);
+    chunk.code[work.mark].b = here();
+    return false;
+
+  case OpValue:
+    if (exp.count == 0) {
+      emit(VmPush, add(chunk.constants, exp.head));
+    } else {
+      emit(VmPushList, add(chunk.lists, ast.to_expression(work.index)));
+    }
+    return false;
+  }
+  return false;
+}
+
+} // namespace
+
+Chunk compile(const Ast & ast){
+  Chunk chunk;
+  Compiler compiler(ast, chunk);
+  if (ast.empty()) {
+    compiler.emit(VmPush, 0);
+    chunk.constants.push_back(Atom());
+  } else {
+    compiler.compile(ast.root());
+  }
+  compiler.emit(VmHalt);
+  return chunk;
+}
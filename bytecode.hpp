@@ -0,0 +1,67 @@
+#ifndef BYTECODE_HPP
+#define BYTECODE_HPP
+
+// system includes
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// module includes
+#include "ast.hpp"
+#include "expression.hpp"
+
+// VmOp is the instruction set of the stack VM
+enum VmOp : unsigned char {
+  VmPush,        // push constants[a]
+  VmPushList,    // push lists[a], a value that has a tail
+  VmLookup,      // look up symbols[a]: a procedure or closure is kept for
+                 // the next VmCall, a value is pushed and execution jumps to b
+  VmLocal,       // like VmLookup for the lambda parameter at depth a >> 16,
+                 // slot a & 0xFFFF
+  VmCall,        // apply the procedure from VmLookup to the top a values,
+                 // with no values a closure is pushed instead of called
+  VmTailCall,    // VmCall in tail position, a closure call reuses the
+                 // caller's return instead of returning to it
+  VmClosure,     // push a closure of the lambda node a, taking b arguments
+  VmReturn,      // return from a closure call, keeping the top value
+  VmDefine,      // bind symbols[a] to the top value, leaving it in place
+  VmSet,         // assign the top value to the binding of symbols[a],
+                 // leaving it in place
+  VmSetLocal,    // assign the top value to the parameter at address a,
+                 // as for VmLocal, leaving it in place
+  VmJumpIfFalse, // pop a boolean, jump to a if it is false
+  VmJumpIfEqual, // check the top is a boolean argument: if it equals b,
+                 // keep it as the result and jump to a, else pop it
+  VmJump,        // jump to a
+  VmPop,         // drop the top value
+  VmThrow,       // raise an InterpreterSemanticError with errors[a]
+  VmHalt         // stop, the top value is the result
+};
+
+struct Instr{
+  VmOp op;
+  std::uint32_t a;
+  std::uint32_t b;
+  // the address of the VM's code for op, set when the chunk is linked
+  // for threaded dispatch, see Program::linked_chunk
+  const void * handler = nullptr;
+};
+
+// A Chunk is a compiled program and the pools its instructions index
+struct Chunk{
+  std::vector<Instr> code;
+  std::vector<Atom> constants;
+  std::vector<Expression> lists;
+  std::vector<Symbol> symbols;
+  std::vector<std::string> errors;
+  // where the body of each lambda node starts
+  std::unordered_map<Ast::Index, std::uint32_t> entries;
+};
+
+// compile the program in ast to bytecode. Malformed special forms
+// compile to VmThrow so they fail only if they are reached, just like
+// in the tree walker.
+Chunk compile(const Ast & ast);
+
+#endif
@@ -1,27 +1,109 @@
 #include "environment.hpp"
 
+#include <atomic>
 #include <cassert>
 #include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <utility>
+#include <vector>
 
 #include "interpreter_semantic_error.hpp"
 #include "log.hpp"
 
+namespace {
+
+// checked int64 arithmetic, false if the exact result does not fit.
+// MSVC has no overflow builtins, so it checks the operands' range first
+#ifdef _MSC_VER
+const std::int64_t int_min = std::numeric_limits<std::int64_t>::min();
+const std::int64_t int_max = std::numeric_limits<std::int64_t>::max();
+
+bool checked_add(std::int64_t a, std::int64_t b, std::int64_t * r) noexcept {
+  if (b > 0 ? a > int_max - b : a < int_min - b) return false;
+  *r = a + b;
+  return true;
+}
+
+bool checked_sub(std::int64_t a, std::int64_t b, std::int64_t * r) noexcept {
+  if (b > 0 ? a < int_min + b : a > int_max + b) return false;
+  *r = a - b;
+  return true;
+}
+
+bool checked_mul(std::int64_t a, std::int64_t b, std::int64_t * r) noexcept {
+  if (a > 0 ? (b > 0 ? a > int_max / b : b < int_min / a)
+            : (b > 0 ? a < int_min / b : b != 0 && a < int_max / b)) return false;
+  *r = a * b;
+  return true;
+}
+#else
+bool checked_add(std::int64_t a, std::int64_t b, std::int64_t * r) noexcept {
+  return !__builtin_add_overflow(a, b, r);
+}
+
+bool checked_sub(std::int64_t a, std::int64_t b, std::int64_t * r) noexcept {
+  return !__builtin_sub_overflow(a, b, r);
+}
+
+bool checked_mul(std::int64_t a, std::int64_t b, std::int64_t * r) noexcept {
+  return !__builtin_mul_overflow(a, b, r);
+}
+#endif
+
+// Number arithmetic for the builtins. Integer operands stay exact,
+// a double operand or an overflowing result makes the result a double.
+Number add(const Number & a, const Number & b) noexcept {
+  std::int64_t r;
+  if (a.is_integer() && b.is_integer() && checked_add(a.integer(), b.integer(), &r)) return r;
+  return a.real() + b.real();
+}
+
+Number sub(const Number & a, const Number & b) noexcept {
+  std::int64_t r;
+  if (a.is_integer() && b.is_integer() && checked_sub(a.integer(), b.integer(), &r)) return r;
+  return a.real() - b.real();
+}
+
+Number mul(const Number & a, const Number & b) noexcept {
+  std::int64_t r;
+  if (a.is_integer() && b.is_integer() && checked_mul(a.integer(), b.integer(), &r)) return r;
+  return a.real() * b.real();
+}
+
+Number neg(const Number & a) noexcept {
+  if (a.is_integer() && a.integer() != std::numeric_limits<std::int64_t>::min()) return -a.integer();
+  return -a.real();
+}
+
+// compare two Numbers with cmp, exactly if both are integers
+template <typename Compare>
+bool compare(const Number & a, const Number & b, Compare cmp) noexcept {
+  if (a.is_integer() && b.is_integer()) return cmp(a.integer(), b.integer());
+  return cmp(a.real(), b.real());
+}
+
+} // namespace
+
 EnvResult proc_not = {
   ProcedureType,
   Expression(),
-  [](const std::vector<Atom>&args) -> Expression {
+  [](Args args) -> Atom {
     if (args.size() != 1) throw InterpreterSemanticError("incorrect not");
     if (args[0].type != BooleanType) throw InterpreterSemanticError("incorrect arg type");
     return !args[0].value.bool_value;
   }
 };
 
+// the evaluators short-circuit and/or themselves, these strict versions
+// are what the names are bound to
 EnvResult proc_and = {
   ProcedureType,
   Expression(),
-  [](const std::vector<Atom>&args) -> Expression {
+  [](Args args) -> Atom {
     Boolean res = true;
-    for (auto a : args) {
+    for (const auto & a : args) {
       if (a.type != BooleanType) throw InterpreterSemanticError("incorrect arg type");
       res &= a.value.bool_value;
     }
@@ -32,9 +114,9 @@ EnvResult proc_and = {
 EnvResult proc_or = {
   ProcedureType,
   Expression(),
-  [](const std::vector<Atom>&args) -> Expression {
+  [](Args args) -> Atom {
     Boolean res = false;
-    for (auto a : args) {
+    for (const auto & a : args) {
       if (a.type != BooleanType) throw InterpreterSemanticError("incorrect arg type");
       res |= a.value.bool_value;
     }
@@ -45,66 +127,66 @@ EnvResult proc_or = {
 EnvResult proc_lt = {
   ProcedureType,
   Expression(),
-  [](const std::vector<Atom>&args) -> Expression {
+  [](Args args) -> Atom {
     if (args.size() != 2) throw InterpreterSemanticError("incorrect compare");
-    if (args[0].type != NumberType) throw InterpreterSemanticError("incorrect arg type");
-    if (args[1].type != NumberType) throw InterpreterSemanticError("incorrect arg type");
-    return args[0].value.num_value < args[1].value.num_value;
+    if (!is_number(args[0].type)) throw InterpreterSemanticError("incorrect arg type");
+    if (!is_number(args[1].type)) throw InterpreterSemanticError("incorrect arg type");
+    return compare(args[0].number(), args[1].number(), std::less<>());
   }
 };
 
 EnvResult proc_le = {
   ProcedureType,
   Expression(),
-  [](const std::vector<Atom>&args) -> Expression {
+  [](Args args) -> Atom {
     if (args.size() != 2) throw InterpreterSemanticError("incorrect compare");
-    if (args[0].type != NumberType) throw InterpreterSemanticError("incorrect arg type");
-    if (args[1].type != NumberType) throw InterpreterSemanticError("incorrect arg type");
-    return args[0].value.num_value <= args[1].value.num_value;
+    if (!is_number(args[0].type)) throw InterpreterSemanticError("incorrect arg type");
+    if (!is_number(args[1].type)) throw InterpreterSemanticError("incorrect arg type");
+    return compare(args[0].number(), args[1].number(), std::less_equal<>());
   }
 };
 
 EnvResult proc_gt = {
   ProcedureType,
   Expression(),
-  [](const std::vector<Atom>&args) -> Expression {
+  [](Args args) -> Atom {
     if (args.size() != 2) throw InterpreterSemanticError("incorrect compare");
-    if (args[0].type != NumberType) throw InterpreterSemanticError("incorrect arg type");
-    if (args[1].type != NumberType) throw InterpreterSemanticError("incorrect arg type");
-    return args[0].value.num_value > args[1].value.num_value;
+    if (!is_number(args[0].type)) throw InterpreterSemanticError("incorrect arg type");
+    if (!is_number(args[1].type)) throw InterpreterSemanticError("incorrect arg type");
+    return compare(args[0].number(), args[1].number(), std::greater<>());
   }
 };
 
 EnvResult proc_ge = {
   ProcedureType,
   Expression(),
-  [](const std::vector<Atom>&args) -> Expression {
+  [](Args args) -> Atom {
     if (args.size() != 2) throw InterpreterSemanticError("incorrect compare");
-    if (args[0].type != NumberType) throw InterpreterSemanticError("incorrect arg type");
-    if (args[1].type != NumberType) throw InterpreterSemanticError("incorrect arg type");
-    return args[0].value.num_value >= args[1].value.num_value;
+    if (!is_number(args[0].type)) throw InterpreterSemanticError("incorrect arg type");
+    if (!is_number(args[1].type)) throw InterpreterSemanticError("incorrect arg type");
+    return compare(args[0].number(), args[1].number(), std::greater_equal<>());
   }
 };
 
 EnvResult proc_eq = {
   ProcedureType,
   Expression(),
-  [](const std::vector<Atom>&args) -> Expression {
+  [](Args args) -> Atom {
     if (args.size() != 2) throw InterpreterSemanticError("incorrect compare");
-    if (args[0].type != NumberType) throw InterpreterSemanticError("incorrect arg type");
-    if (args[1].type != NumberType) throw InterpreterSemanticError("incorrect arg type");
-    return args[0].value.num_value == args[1].value.num_value;
+    if (!is_number(args[0].type)) throw InterpreterSemanticError("incorrect arg type");
+    if (!is_number(args[1].type)) throw InterpreterSemanticError("incorrect arg type");
+    return compare(args[0].number(), args[1].number(), std::equal_to<>());
   }
 };
 
 EnvResult proc_add = {
   ProcedureType,
   Expression(),
-  [](const std::vector<Atom>&args) -> Expression {
-    Number sum = 0.;
-    for (auto a : args) {
-      if (a.type != NumberType) throw InterpreterSemanticError("incorrect arg type");
-      sum += a.value.num_value;
+  [](Args args) -> Atom {
+    Number sum = 0;
+    for (const auto & a : args) {
+      if (!is_number(a.type)) throw InterpreterSemanticError("incorrect arg type");
+      sum = add(sum, a.number());
     }
     return sum;
   }
@@ -113,16 +195,16 @@ EnvResult proc_add = {
 EnvResult proc_sub = {
   ProcedureType,
   Expression(),
-  [](const std::vector<Atom>&args) -> Expression {
+  [](Args args) -> Atom {
     if (args.size() > 2) {
       throw InterpreterSemanticError("incorrect sub, too many args");
     } else if (args.size() == 2) {
-      if (args[0].type != NumberType) throw InterpreterSemanticError("incorrect arg type");
-      if (args[1].type != NumberType) throw InterpreterSemanticError("incorrect arg type");
-      return args[0].value.num_value - args[1].value.num_value;
+      if (!is_number(args[0].type)) throw InterpreterSemanticError("incorrect arg type");
+      if (!is_number(args[1].type)) throw InterpreterSemanticError("incorrect arg type");
+      return sub(args[0].number(), args[1].number());
     } else if (args.size() == 1) {
-      if (args[0].type != NumberType) throw InterpreterSemanticError("incorrect arg type");
-      return -args[0].value.num_value;
+      if (!is_number(args[0].type)) throw InterpreterSemanticError("incorrect arg type");
+      return neg(args[0].number());
     } else {
       throw InterpreterSemanticError("incorrect sub, too few args");
     }
@@ -132,11 +214,11 @@ EnvResult proc_sub = {
 EnvResult proc_mul = {
   ProcedureType,
   Expression(),
-  [](const std::vector<Atom>&args) -> Expression {
-    Number prod = 1.;
-    for (auto a : args) {
-      if (a.type != NumberType) throw InterpreterSemanticError("incorrect arg type");
-      prod *= a.value.num_value;
+  [](Args args) -> Atom {
+    Number prod = 1;
+    for (const auto & a : args) {
+      if (!is_number(a.type)) throw InterpreterSemanticError("incorrect arg type");
+      prod = mul(prod, a.number());
     }
     return prod;
   }
@@ -145,32 +227,32 @@ EnvResult proc_mul = {
 EnvResult proc_div = {
   ProcedureType,
   Expression(),
-  [](const std::vector<Atom>&args) -> Expression {
+  [](Args args) -> Atom {
     if (args.size() != 2) throw InterpreterSemanticError("incorrect compare");
-    if (args[0].type != NumberType) throw InterpreterSemanticError("incorrect arg type");
-    if (args[1].type != NumberType) throw InterpreterSemanticError("incorrect arg type");
-    return args[0].value.num_value / args[1].value.num_value;
+    if (!is_number(args[0].type)) throw InterpreterSemanticError("incorrect arg type");
+    if (!is_number(args[1].type)) throw InterpreterSemanticError("incorrect arg type");
+    return args[0].number().real() / args[1].number().real();
   }
 };
 
 EnvResult proc_log = {
   ProcedureType,
   Expression(),
-  [](const std::vector<Atom>&args) -> Expression {
+  [](Args args) -> Atom {
     if (args.size() != 1) throw InterpreterSemanticError("incorrect log");
-    if (args[0].type != NumberType) throw InterpreterSemanticError("incorrect arg type");
-    return log10(args[0].value.num_value);
+    if (!is_number(args[0].type)) throw InterpreterSemanticError("incorrect arg type");
+    return log10(args[0].number().real());
   }
 };
 
 EnvResult proc_pow = {
   ProcedureType,
   Expression(),
-  [](const std::vector<Atom>&args) -> Expression {
+  [](Args args) -> Atom {
     if (args.size() != 2) throw InterpreterSemanticError("incorrect pow");
-    if (args[0].type != NumberType) throw InterpreterSemanticError("incorrect arg type");
-    if (args[1].type != NumberType) throw InterpreterSemanticError("incorrect arg type");
-    return pow(args[0].value.num_value, args[1].value.num_value);
+    if (!is_number(args[0].type)) throw InterpreterSemanticError("incorrect arg type");
+    if (!is_number(args[1].type)) throw InterpreterSemanticError("incorrect arg type");
+    return pow(args[0].number().real(), args[1].number().real());
   }
 };
 
@@ -179,38 +261,192 @@ EnvResult const_pi = {
   Expression(atan2(0, -1))
 };
 
-Environment::Environment(){
-  // add default env
-  envmap["not"] = proc_not;
-  envmap["and"] = proc_and;
-  envmap["or"] = proc_or;
-  envmap["<"] = proc_lt;
-  envmap["<="] = proc_le;
-  envmap[">"] = proc_gt;
-  envmap[">="] = proc_ge;
-  envmap["="] = proc_eq;
-  envmap["+"] = proc_add;
-  envmap["-"] = proc_sub;
-  envmap["*"] = proc_mul;
-  envmap["/"] = proc_div;
-  envmap["log10"] = proc_log;
-  envmap["pow"] = proc_pow;
-  envmap["pi"] = const_pi;
+namespace {
+
+// Builtins is the default environment. It is built once per process,
+// never changes, and is shared by every Environment. Builtin names are
+// interned at startup, so their ids are small and a direct-indexed
+// array by symbol id is a perfect hash for them.
+class Builtins{
+public:
+  Builtins(){
+    add("not", proc_not);
+    add("and", proc_and);
+    add("or", proc_or);
+    add("<", proc_lt);
+    add("<=", proc_le);
+    add(">", proc_gt);
+    add(">=", proc_ge);
+    add("=", proc_eq);
+    add("+", proc_add);
+    add("-", proc_sub);
+    add("*", proc_mul);
+    add("/", proc_div);
+    add("log10", proc_log);
+    add("pow", proc_pow);
+    add("pi", const_pi);
+  }
+
+  const EnvResult * find(Symbol sym) const noexcept{
+    return sym.index() < by_id.size() ? by_id[sym.index()] : nullptr;
+  }
+
+private:
+  void add(Symbol sym, const EnvResult & res){
+    if (sym.index() >= by_id.size()) by_id.resize(sym.index() + 1, nullptr);
+    by_id[sym.index()] = &res;
+  }
+
+  std::vector<const EnvResult *> by_id;
+};
+
+const Builtins & builtins(){
+  static const Builtins table;
+  return table;
+}
+
+// build the table during static initialization, after the builtins
+// above, so builtin names are among the first symbols interned
+const Builtins & builtins_at_startup = builtins();
+
+} // namespace
+
+const EnvResult * Environment::find_builtin(Symbol sym) noexcept {
+  return builtins().find(sym);
+}
+
+std::uint64_t Environment::next_epoch() noexcept {
+  static std::atomic<std::uint64_t> epochs{1}; // 0 marks an empty cache
+  return epochs.fetch_add(1, std::memory_order_relaxed);
+}
+
+const EnvResult * Environment::find(Symbol sym, BindingCache * cache) const noexcept {
+  if (!cache) return find(sym);
+  if (cache->epoch != current_epoch) {
+    cache->binding = find(sym);
+    cache->epoch = cache->binding ? current_epoch : 0;
+  }
+  return cache->binding;
+}
+
+const EnvResult * Environment::find(Symbol sym) const noexcept {
+  if (const EnvResult * builtin = builtins().find(sym)) return builtin;
+  if (const EnvResult * own = envmap.find(sym)) return own;
+  for (const Layer * layer = base.get(); layer; layer = layer->below.get()) {
+    if (const EnvResult * frozen = layer->map.find(sym)) return frozen;
+  }
+  return nullptr;
+}
+
+Environment::Snapshot Environment::snapshot() {
+  if (envmap.size() == 0 && frames.empty()) return Snapshot(base);
+  freeze_frames();
+  std::size_t depth = base ? base->depth + 1 : 1;
+  auto layer = std::make_shared<Layer>();
+  if (depth > MAX_DEPTH) {
+    // merge every layer into the new one, newest first: a name assigned
+    // since it was frozen is in more than one, and insert keeps the first
+    envmap.for_each([&](Symbol sym, const EnvResult & res) {
+      layer->map.insert(sym, res);
+    });
+    layer->frames = std::move(frames);
+    for (const Layer * l = base.get(); l; l = l->below.get()) {
+      l->map.for_each([&](Symbol sym, const EnvResult & res) {
+        layer->map.insert(sym, res);
+      });
+      layer->frames.insert(l->frames.begin(), l->frames.end());
+    }
+    layer->depth = 1;
+    layer->has_frames = !layer->frames.empty();
+  } else {
+    layer->map = std::move(envmap);
+    layer->frames = std::move(frames);
+    layer->below = base;
+    layer->depth = depth;
+    layer->has_frames = !layer->frames.empty() || (base && base->has_frames);
+  }
+  base = std::move(layer);
+  envmap = SymbolMap<EnvResult>();
+  frames = FrameMap();
+  // a flattened layer holds copies, bindings found before are gone
+  current_epoch = next_epoch();
+  return Snapshot(base);
+}
+
+void Environment::freeze_frames() {
+  // lists are literals, so a closure is only ever the head of a value
+  std::vector<Frame *> pending;
+  auto reach = [&](const Expression & exp) {
+    if (exp.head.type == LambdaType) pending.push_back(exp.head.value.closure_value->frame.get());
+  };
+  envmap.for_each([&](Symbol, const EnvResult & res) { reach(res.exp); });
+  for (const auto & copy : frames) pending.push_back(copy.second.get());
+  while (!pending.empty()) {
+    Frame * frame = pending.back();
+    pending.pop_back();
+    if (!frame || frame->frozen) continue;
+    frame->frozen = true;
+    pending.push_back(frame->parent.get());
+    for (const Expression & slot : frame->slots) reach(slot);
+  }
+}
+
+Frame * Environment::current(Frame * frame) const noexcept {
+  if (!frame->frozen) return frame;
+  if (!frames.empty()) {
+    auto copy = frames.find(frame);
+    if (copy != frames.end()) return copy->second.get();
+  }
+  for (const Layer * layer = base.get(); layer && layer->has_frames; layer = layer->below.get()) {
+    auto copy = layer->frames.find(frame);
+    if (copy != layer->frames.end()) return copy->second.get();
+  }
+  return frame;
+}
+
+const Expression & Environment::local(Frame * frame, std::uint16_t depth, std::uint16_t slot) const noexcept {
+  for (; depth > 0; depth--) frame = frame->parent.get();
+  return current(frame)->slots[slot];
+}
+
+Expression & Environment::assignable_local(Frame * frame, std::uint16_t depth, std::uint16_t slot) {
+  for (; depth > 0; depth--) frame = frame->parent.get();
+  Frame * target = current(frame);
+  if (target->frozen) {
+    // shared with forks, assign a copy of this Environment's own. Its
+    // parent is still the frame the original links to.
+    auto copy = std::make_shared<Frame>(*target);
+    copy->frozen = false;
+    target = copy.get();
+    frames[frame] = std::move(copy);
+  }
+  return target->slots[slot];
 }
 
 bool Environment::lookup(Symbol sym, EnvResult &res) {
-  auto it = envmap.find(sym);
-  if (it == envmap.end()) {
+  const EnvResult * found = find(sym);
+  if (!found) {
     return false;
   }
-  res = it->second;
+  res = *found;
   return true;
 }
 
-bool Environment::define(Symbol sym, Expression exp) {
-  if (envmap.find(sym) != envmap.end()) {
-    return false;
+Expression * Environment::assignable(Symbol sym) {
+  if (EnvResult * own = envmap.find(sym)) return &own->exp;
+  if (builtins().find(sym)) return nullptr;
+  for (const Layer * layer = base.get(); layer; layer = layer->below.get()) {
+    if (layer->map.find(sym)) {
+      // frozen layers are shared with forks, so shadow the binding here
+      current_epoch = next_epoch();
+      return &envmap.insert(sym, {ExpressionType, Expression(), nullptr}).first->exp;
+    }
   }
-  envmap[sym] = {ExpressionType, exp};
-  return true;
+  return nullptr;
+}
+
+bool Environment::define(Symbol sym, Expression exp) {
+  // a new name shadows nothing, so cached bindings stay valid
+  if (find(sym)) return false;
+  return envmap.insert(sym, {ExpressionType, std::move(exp), nullptr}).second;
 }
\ No newline at end of file
@@ -2,27 +2,124 @@
 #define ENVIRONMENT_HPP
 
 // system includes
-#include <map>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
 
 // module includes
 #include "expression.hpp"
+#include "program.hpp"
+#include "symbol_map.hpp"
 
 enum EnvResultType {ExpressionType, ProcedureType};
 struct EnvResult{
   EnvResultType type;
   Expression exp;
-  Procedure proc;
+  Procedure proc = nullptr;
 };
 
+// Environment layers the user's definitions over the builtins, which
+// are shared by all Environments and cost nothing to set up.
+//
+// A snapshot freezes the current definitions into an immutable layer
+// that any number of Environments can start from. Later defines go to
+// the Environment's own overlay, so the shared layers are never copied.
+// Assigning to a frozen binding copies it into the overlay first. The
+// same goes for the frames of frozen closures: assigning to a lambda
+// parameter in one copies the frame into this Environment, and it is
+// read from the copy from then on.
+//
+// Every change to what a bound symbol resolves to starts a new epoch,
+// drawn from a counter shared by all Environments, so a binding cached
+// at one epoch is valid exactly while it is current. Defines cannot
+// shadow a binding, only assigning to a snapshot's binding and taking
+// a snapshot start one.
 class Environment{
+  struct Layer;
+  typedef std::unordered_map<const Frame *, std::shared_ptr<Frame>> FrameMap;
 public:
-  Environment();
+  // a frozen set of definitions, cheap to copy and safe to share
+  // between threads
+  class Snapshot{
+  public:
+    Snapshot() = default;
+  private:
+    friend class Environment;
+    explicit Snapshot(std::shared_ptr<const Layer> top): top(std::move(top)) {};
+    std::shared_ptr<const Layer> top;
+  };
+
+  Environment() = default;
+  // start from the definitions in a snapshot, in O(1)
+  explicit Environment(const Snapshot & base): base(base.top) {};
+
+  // closures in the bindings share the frames they were made in, which
+  // are assigned in place until frozen, so share definitions through a
+  // snapshot instead of copying
+  Environment(const Environment &) = delete;
+  Environment & operator=(const Environment &) = delete;
+  Environment(Environment &&) = default;
+  Environment & operator=(Environment &&) = default;
+
+  // freeze the definitions made so far, they stay visible here
+  Snapshot snapshot();
+
+  // the builtin binding for a symbol, or nullptr
+  static const EnvResult * find_builtin(Symbol) noexcept;
+
+  // the binding for a symbol, or nullptr if it is unbound. Bindings are
+  // never removed, so the pointer stays valid until the next snapshot.
+  const EnvResult * find(Symbol) const noexcept;
+  // the binding for the symbol, taken from cache while its epoch is
+  // current. A cache may be nullptr.
+  const EnvResult * find(Symbol, BindingCache *) const noexcept;
+  // changes whenever find could return a different binding for some
+  // symbol, and is never the same for two Environments
+  std::uint64_t epoch() const noexcept { return current_epoch; }
+  // copy the binding for a symbol into res, false if it is unbound
   bool lookup(Symbol, EnvResult&);
   bool define(Symbol, Expression);
+  // the value of a user binding, to be assigned in place. nullptr for
+  // builtins and unbound symbols. A binding from a snapshot is shadowed
+  // by a new one here, left for the caller to fill in.
+  Expression * assignable(Symbol);
+
+  // the lambda parameter depth frames out from frame, at slot
+  const Expression & local(Frame * frame, std::uint16_t depth, std::uint16_t slot) const noexcept;
+  // the same parameter, to be assigned in place
+  Expression & assignable_local(Frame * frame, std::uint16_t depth, std::uint16_t slot);
 private:
+  struct Layer{
+    SymbolMap<EnvResult> map;
+    std::shared_ptr<const Layer> below;
+    std::size_t depth;
+    // copies of frozen frames, by the frame they replace
+    FrameMap frames;
+    // whether this layer or one below it has frames
+    bool has_frames;
+  };
+  // past this many layers a snapshot flattens them into one, so lookups
+  // stay bounded however often snapshots are taken
+  static constexpr std::size_t MAX_DEPTH = 8;
+
+  // frozen definitions, newest first
+  std::shared_ptr<const Layer> base;
+
+  // Environment is a mapping from symbols to expressions or procedures,
+  // this holds the user definitions made since the last snapshot
+  SymbolMap<EnvResult> envmap;
+  // frozen frames assigned to since the last snapshot, by the frame
+  // they replace
+  FrameMap frames;
+
+  // frame, or the copy of it that replaces it here
+  Frame * current(Frame * frame) const noexcept;
+  // mark the frames reachable from the bindings about to be frozen
+  void freeze_frames();
 
-  // Environment is a mapping from symbols to expressions or procedures
-  std::map<Symbol,EnvResult> envmap;
+  static std::uint64_t next_epoch() noexcept;
+  std::uint64_t current_epoch = next_epoch();
 };
 
 #endif
@@ -1,31 +1,37 @@
 #include "expression.hpp"
 
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
 #include <cmath>
+#include <cstdlib>
 #include <limits>
 #include <cctype>
 #include <exception>
-#include <regex>
 
 // system includes
 #include <sstream>
 
-Expression::Expression(bool tf){
-  head.type = BooleanType;
-  head.value.bool_value = tf;
-}
+Expression::Expression(bool tf): head(tf){}
+
+Expression::Expression(double num): head(num){}
 
-Expression::Expression(double num){
-  head.type = NumberType;
-  head.value.num_value = num;
+Expression::Expression(Number num): head(num){}
+
+std::ostream & operator<<(std::ostream & out, const Number & num){
+  if (num.is_integer()) return out << num.integer();
+  return out << num.real();
 }
 
-Expression::Expression(const std::string & sym){
+Expression::Expression(Symbol sym){
   head.type = SymbolType;
   head.value.sym_value = sym;
 }
 
 bool Expression::operator==(const Expression & exp) const noexcept{
-  if (head.type != exp.head.type) return false;
+  // integers and doubles compare by value, so 1 == 1.0
+  if (head.type != exp.head.type && !(is_number(head.type) && is_number(exp.head.type)))
+    return false;
   switch (head.type)
   {
   case NoneType:
@@ -37,20 +43,30 @@ bool Expression::operator==(const Expression & exp) const noexcept{
     break;
 
   case NumberType:
-    if (head.value.num_value != exp.head.value.num_value)
+  case RealType:
+    if (head.number() != exp.head.number())
       return false;
     break;
 
   case SymbolType:
+  case KeywordType:
     if (head.value.sym_value != exp.head.value.sym_value)
       return false;
     break;
 
+  case LambdaType:
+    if (head.value.closure_value != exp.head.value.closure_value)
+      return false;
+    break;
+
   default:
     return false;
     break;
   }
   if (tail.size() != exp.tail.size()) return false;
+  for (std::size_t i = 0; i < tail.size(); i++) {
+    if (!(tail[i] == exp.tail[i])) return false;
+  }
   return true;
 }
 
@@ -65,35 +81,189 @@ std::ostream & operator<<(std::ostream & out, const Expression & exp){
     out << (exp.head.value.bool_value ? "True" : "False");
     break;
   case NumberType:
-    out << exp.head.value.num_value;
+  case RealType:
+    out << exp.head.number();
     break;
   case SymbolType:
     out << exp.head.value.sym_value;
     break;
+  case LambdaType:
+    out << "<lambda>";
+    break;
   default:
     break;
   }
-  for (auto e : exp.tail) {
+  for (const auto & e : exp.tail) {
     out << e;
   }
   out << ")";
   return out;
 }
 
-bool token_to_atom(const std::string & token, Atom & atom){
+namespace {
+
+// character classes for the token classifier, C locale
+enum CharClass : unsigned char {
+  CC_DIGIT = 1,  // 0-9
+  CC_HEX = 2,    // 0-9 a-f A-F
+  CC_SPACE = 4,  // what isspace accepts: ' ' \t \n \v \f \r
+};
+
+struct CharClassTable {
+  unsigned char cls[256];
+  constexpr CharClassTable(): cls() {
+    for (int c = '0'; c <= '9'; c++) cls[c] |= CC_DIGIT | CC_HEX;
+    for (int c = 'a'; c <= 'f'; c++) cls[c] |= CC_HEX;
+    for (int c = 'A'; c <= 'F'; c++) cls[c] |= CC_HEX;
+    for (char c : {' ', '\t', '\n', '\v', '\f', '\r'}) cls[static_cast<unsigned char>(c)] |= CC_SPACE;
+  }
+  bool is(char c, unsigned char mask) const {
+    return cls[static_cast<unsigned char>(c)] & mask;
+  }
+};
+
+constexpr CharClassTable char_class;
+
+// case-insensitive match of the lowercase word w at s[i...]
+bool match_word(std::string_view s, std::size_t i, const char * w){
+  for (; *w; w++, i++) {
+    if (i >= s.size() || (s[i] | 0x20) != *w) return false;
+  }
+  return true;
+}
+
+// Outcome of classifying a numeric-looking token. Mirrors what
+// strtod followed by std::stod used to decide:
+//   NotNumber - strtod would not consume the whole token, or the
+//               value is +HUGE_VAL; the token may still be a symbol
+//   BadNumber - a complete number that std::stod rejects as out of range
+//   IsNumber  - num holds the value
+enum NumberClass {NotNumber, BadNumber, IsNumber};
+
+// the strtod grammar, finding where a number starting at s[i] ends
+// and whether it needs from_chars' hex format
+std::size_t scan_number(std::string_view s, std::size_t i, bool & hex, bool & nonzero){
+  const std::size_t n = s.size();
+  hex = false;
+  nonzero = false;
+
+  if (match_word(s, i, "inf")) {
+    return match_word(s, i + 3, "inity") ? i + 8 : i + 3;
+  }
+  if (match_word(s, i, "nan")) {
+    i += 3;
+    if (i < n && s[i] == '(') { // optional (n-char-sequence)
+      std::size_t j = i + 1;
+      while (j < n && (std::isalnum(static_cast<unsigned char>(s[j])) || s[j] == '_')) j++;
+      if (j < n && s[j] == ')') i = j + 1;
+    }
+    return i;
+  }
+
+  unsigned char digit = CC_DIGIT;
+  char exp_mark = 'e';
+  if (i + 1 < n && s[i] == '0' && (s[i + 1] | 0x20) == 'x'
+      && ((i + 2 < n && char_class.is(s[i + 2], CC_HEX))
+          || (i + 3 < n && s[i + 2] == '.' && char_class.is(s[i + 3], CC_HEX)))) {
+    hex = true;
+    digit = CC_HEX;
+    exp_mark = 'p';
+    i += 2;
+  }
+
+  std::size_t start = i;
+  std::size_t digits = 0;
+  for (; i < n && char_class.is(s[i], digit); i++, digits++) nonzero |= s[i] != '0';
+  if (i < n && s[i] == '.') {
+    i++;
+    for (; i < n && char_class.is(s[i], digit); i++, digits++) nonzero |= s[i] != '0';
+  }
+  if (digits == 0) return start; // nothing numeric here
+
+  if (i < n && (s[i] | 0x20) == exp_mark) { // exponent needs at least one digit
+    std::size_t j = i + 1;
+    if (j < n && (s[j] == '+' || s[j] == '-')) j++;
+    if (j < n && char_class.is(s[j], CC_DIGIT)) {
+      while (j < n && char_class.is(s[j], CC_DIGIT)) j++;
+      i = j;
+    }
+  }
+  return i;
+}
+
+// decide whether token is a number and convert it, in one pass
+NumberClass classify_number(std::string_view s, Number & num){
+  const std::size_t n = s.size();
+  std::size_t i = 0;
+  while (i < n && char_class.is(s[i], CC_SPACE)) i++;
+
+  bool negative = false;
+  std::size_t sign = i;
+  if (i < n && (s[i] == '+' || s[i] == '-')) {
+    negative = s[i] == '-';
+    i++;
+  }
+
+  bool hex, nonzero;
+  std::size_t end = scan_number(s, i, hex, nonzero);
+  // strtod saw the token through a c_str(), so an embedded NUL ends it
+  if (end == i || (end < n && s[end] != '\0')) return NotNumber;
+
+  // a plain decimal integer that fits is an exact integer, larger ones
+  // and every other form are doubles
+  if (!hex && std::all_of(s.data() + i, s.data() + end, [](char c) { return char_class.is(c, CC_DIGIT); })) {
+    std::int64_t integer;
+    std::size_t from = negative ? sign : i;
+    std::from_chars_result r = std::from_chars(s.data() + from, s.data() + end, integer);
+    if (r.ec == std::errc()) {
+      num = integer;
+      return IsNumber;
+    }
+  }
+
+  // from_chars takes neither a leading '+' nor a "0x" prefix
+  std::from_chars_result r;
+  double val = 0.;
+  if (hex) {
+    r = std::from_chars(s.data() + i + 2, s.data() + end, val, std::chars_format::hex);
+    if (negative) val = -val;
+  } else {
+    std::size_t from = negative ? sign : i;
+    r = std::from_chars(s.data() + from, s.data() + end, val);
+  }
+
+  // out-of-range and denormal results follow strtod's errno rules,
+  // which are not worth replicating on this rare path
+  if (r.ec != std::errc() || std::fpclassify(val) == FP_SUBNORMAL
+      || (val == 0. && nonzero)) {
+    std::string copy(s.substr(0, end));
+    errno = 0;
+    val = strtod(copy.c_str(), nullptr);
+    if (val == HUGE_VAL) return NotNumber;
+    if (errno == ERANGE) return BadNumber;
+  } else if (val == HUGE_VAL) {
+    return NotNumber;
+  }
+
+  num = val;
+  return IsNumber;
+}
+
+// a symbol is a non-digit, non-space byte followed by non-space bytes
+bool is_symbol(std::string_view s){
+  if (s.empty() || char_class.is(s[0], CC_DIGIT | CC_SPACE)) return false;
+  for (char c : s) {
+    if (char_class.is(c, CC_SPACE)) return false;
+  }
+  return true;
+}
+
+} // namespace
+
+bool token_to_atom(std::string_view token, Atom & atom){
   // return true if it a token is valid. otherwise, return false.
-  auto is_num = [](const std::string & s) -> bool {
-    char *end = 0;
-    double val = strtod(s.c_str(), &end);
-    return end != s.c_str() && *end == '\0' && val != HUGE_VAL;
-  };
-  auto is_sym = [](const std::string & s) -> bool {
-    std::regex sym("[^\\d\\s]\\S*");
-    if (std::regex_match(s, sym)) return true;
-    else return false;
-  };
-
-  if (token == "begin" || token == "define" || token == "if") {
+  if (token == "begin" || token == "define" || token == "if" || token == "lambda"
+      || token == "while" || token == "set!") {
     atom.type = KeywordType;
     atom.value.sym_value = token;
   } else if (token == "(" || token == ")") {
@@ -104,19 +274,21 @@ bool token_to_atom(const std::string & token, Atom & atom){
   } else if (token == "False") {
     atom.type = BooleanType;
     atom.value.bool_value = false;
-  } else if (is_num(token)) {
-    try {
-      atom.type = NumberType;
-      atom.value.num_value = std::stod(token);
-    } catch (const std::out_of_range&) {
+  } else {
+    Number num;
+    switch (classify_number(token, num))
+    {
+    case IsNumber:
+      atom = Atom(num);
+      break;
+    case BadNumber:
       return false;
+    case NotNumber:
+      if (!is_symbol(token)) return false;
+      atom.type = SymbolType;
+      atom.value.sym_value = token;
+      break;
     }
-  } else if (is_sym(token)) {
-    atom.type = SymbolType;
-    atom.value.sym_value = token;
-  } else {
-    return false;
   }
   return true;
 }
-
@@ -2,34 +2,135 @@
 #define TYPES_HPP
 
 // system includes
+#include <cstdint>
+#include <ostream>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
-// A Type is a literal boolean, literal number, or symbol
-enum Type {NoneType, BooleanType, NumberType, ListType, SymbolType, KeywordType};
+// module includes
+#include "symbol.hpp"
+
+// A Type is a literal boolean, literal number, or symbol,
+// or a function made by lambda. A number is a NumberType when it
+// is an exact integer and a RealType when it is a double
+enum Type : unsigned char {NoneType, BooleanType, NumberType, RealType, ListType, SymbolType, KeywordType, LambdaType};
+
+// whether a type is either kind of number
+inline bool is_number(Type type) noexcept{
+  return type == NumberType || type == RealType;
+}
+
+// a function value, see program.hpp
+struct Closure;
+
+// LambdaType Atoms count their references to a Closure, and the last
+// one to let go of it deletes it
+void retain(const Closure *) noexcept;
+void release(const Closure *) noexcept;
 
 // A Boolean is a C++ bool
 typedef bool Boolean;
 
-// A Number is a C++ double
-typedef double Number;
+// A Number is an exact 64-bit integer or a C++ double, the value
+// the builtins compute with. Integer literals lex as integers, and
+// the builtins keep integer arithmetic exact, promoting to double only
+// when an operand is a double, the result overflows, or the operation
+// needs it (/, pow, log10). Atoms do not store a Number, they keep the
+// kind in their type and the payload in their Value, see Atom::number()
+class Number{
+public:
+  Number() noexcept: Number(0.) {};
+  Number(double d) noexcept: integral(false) { rep.d = d; };
+  Number(std::int64_t i) noexcept: integral(true) { rep.i = i; };
+  Number(int i) noexcept: Number(static_cast<std::int64_t>(i)) {};
+
+  bool is_integer() const noexcept { return integral; }
+  // the integer, only valid if is_integer()
+  std::int64_t integer() const noexcept { return rep.i; }
+  // the value as a double, rounding integers beyond 2^53
+  double real() const noexcept { return integral ? static_cast<double>(rep.i) : rep.d; }
+
+  // numeric equality: integers compare exactly, anything involving
+  // a double compares as doubles, so 1 == 1.0
+  friend bool operator==(const Number & a, const Number & b) noexcept{
+    if (a.integral && b.integral) return a.rep.i == b.rep.i;
+    return a.real() == b.real();
+  }
+  friend bool operator!=(const Number & a, const Number & b) noexcept{
+    return !(a == b);
+  }
 
-// A Symbol is a string
-typedef std::string Symbol;
+private:
+  union {
+    std::int64_t i;
+    double d;
+  } rep;
+  bool integral;
+};
+
+// integers print exactly, doubles as an ostream formats them
+std::ostream & operator<<(std::ostream & out, const Number & num);
 
-// A Value is a boolean, number, or symbol
-// cannot use a union because symbol is non-POD
-// this wastes space but is simple 
-struct Value {
+// A Value is a boolean, integer, double, symbol, or closure
+// all of them are trivially copyable, so they share storage
+// and the Atom's type says which one is live
+union Value {
   Boolean bool_value;
-  Number num_value;
+  // a NumberType's integer
+  std::int64_t num_value;
+  // a RealType's double
+  double real_value;
   Symbol sym_value;
+  // shared by the LambdaType Atoms that hold it
+  const Closure * closure_value;
+
+  Value(): num_value(0) {};
 };
-  
-// An Atom has a type and value
+
+// An Atom has a type and value, 16 bytes with padding. This is not
+// NaN-boxed into a single word: the type and value are public members
+// that callers and tests read directly, and an exact 64-bit integer
+// leaves no spare bits for a tag
 struct Atom{
   Type type;
   Value value;
+
+  Atom(): type(NoneType) {};
+  Atom(Boolean tf): type(BooleanType) { value.bool_value = tf; };
+  Atom(double num): type(RealType) { value.real_value = num; };
+  Atom(std::int64_t num): type(NumberType) { value.num_value = num; };
+  Atom(Number num): type(num.is_integer() ? NumberType : RealType){
+    if (type == NumberType) value.num_value = num.integer();
+    else value.real_value = num.real();
+  };
+  explicit Atom(const Closure * closure) noexcept: type(LambdaType){
+    value.closure_value = closure;
+    retain(closure);
+  };
+
+  // copies of a LambdaType Atom share its closure
+  Atom(const Atom & atom) noexcept: type(atom.type), value(atom.value){
+    if (type == LambdaType) retain(value.closure_value);
+  };
+  Atom(Atom && atom) noexcept: type(atom.type), value(atom.value){
+    atom.type = NoneType;
+  };
+  Atom & operator=(Atom atom) noexcept{
+    std::swap(type, atom.type);
+    std::swap(value, atom.value);
+    return *this;
+  };
+  ~Atom(){
+    if (type == LambdaType) release(value.closure_value);
+  };
+
+  // the number, only valid if is_number(type)
+  Number number() const noexcept{
+    if (type == NumberType) return value.num_value;
+    return value.real_value;
+  }
 };
 
 // An expression is an atom called the head
@@ -46,19 +147,39 @@ struct Expression{
   Expression(const Atom & atom): head(atom){};
   Expression(bool tf);
   Expression(double num);
-  Expression(const std::string & sym);
+  Expression(Number num);
+  Expression(Symbol sym);
 
   bool operator==(const Expression & exp) const noexcept;
 };
 
 
+// Args is a read-only view of a procedure's evaluated arguments.
+// Callers keep the Atoms in their own storage, usually on the stack.
+class Args{
+public:
+  Args(const Atom * data, std::size_t size): data(data), count(size) {};
+
+  std::size_t size() const noexcept { return count; }
+  const Atom & operator[](std::size_t i) const noexcept { return data[i]; }
+  const Atom * begin() const noexcept { return data; }
+  const Atom * end() const noexcept { return data + count; }
+
+private:
+  const Atom * data;
+  std::size_t count;
+};
+
+// calls with at most this many arguments keep them on the caller's stack
+const std::size_t MAX_INLINE_ARGS = 8;
+
 // A Procedure is a C++ function pointer taking
-// a vector of Atoms as arguments
-typedef Expression (*Procedure)(const std::vector<Atom> & args);
+// a view of Atoms as arguments and returning an Atom
+typedef Atom (*Procedure)(Args args);
 
 // format an expression for output
 std::ostream & operator<<(std::ostream & out, const Expression & exp);
 
 // map a token to an Atom
-bool token_to_atom(const std::string & token, Atom & atom);
+bool token_to_atom(std::string_view token, Atom & atom);
 #endif
@@ -0,0 +1,135 @@
+#include "fold.hpp"
+
+// system includes
+#include <vector>
+
+// module includes
+#include "environment.hpp"
+#include "interpreter_semantic_error.hpp"
+
+namespace {
+
+// whether the evaluator evaluates the i-th child of node
+bool evaluates(const Node & node, std::uint32_t i) noexcept{
+  switch (node.op)
+  {
+  case OpBegin:
+  case OpSymbol:
+  case OpAnd:
+  case OpOr:
+  case OpLocal:
+  case OpWhile:
+    return true;
+  case OpDefine:
+  case OpLambda:
+  case OpSet:
+    return node.count == 2 && i == 1;
+  case OpIf:
+    return node.count == 3;
+  default:
+    return false;
+  }
+}
+
+// whether folding could change node
+bool foldable(const Node & node) noexcept{
+  return node.op == OpBegin || node.op == OpDefine || node.op == OpIf
+    || node.op == OpSymbol || node.op == OpAnd || node.op == OpOr
+    || node.op == OpLambda || node.op == OpLocal || node.op == OpWhile || node.op == OpSet;
+}
+
+// fold node itself once its tail has been folded, false if it stays
+bool fold_node(const Node & node, const Node * tail, Node & folded){
+  if (node.op == OpIf && node.count == 3) {
+    const Node & cond = tail[0];
+    // a value's head is what the condition evaluates to
+    if (cond.op != OpValue || cond.head.type != BooleanType) return false;
+    folded = cond.head.value.bool_value ? tail[1] : tail[2];
+    return true;
+  }
+  if (node.op == OpAnd || node.op == OpOr) {
+    // constant arguments up to the deciding one fold, as in eval
+    Boolean decides = node.op == OpOr;
+    for (std::uint32_t i = 0; i < node.count; i++) {
+      if (tail[i].op != OpValue || tail[i].head.type != BooleanType) return false;
+      if (tail[i].head.value.bool_value == decides) {
+        folded = Node{Atom(decides), 0, 0, OpValue};
+        return true;
+      }
+    }
+    folded = Node{Atom(!decides), 0, 0, OpValue};
+    return true;
+  }
+  if (node.op != OpSymbol) return false;
+
+  // builtins cannot be redefined, so these bindings are final
+  const EnvResult * builtin = Environment::find_builtin(node.head.value.sym_value);
+  if (!builtin) return false;
+  if (builtin->type == ExpressionType) {
+    if (!builtin->exp.tail.empty()) return false;
+    folded = Node{builtin->exp.head, 0, 0, OpValue};
+    return true;
+  }
+
+  // every builtin is pure, so a call on constants can run now
+  std::vector<Atom> args(node.count);
+  for (std::uint32_t i = 0; i < node.count; i++) {
+    if (tail[i].op != OpValue) return false;
+    args[i] = tail[i].head;
+  }
+  try {
+    folded = Node{builtin->proc(Args(args.data(), args.size())), 0, 0, OpValue};
+    return true;
+  } catch (const InterpreterSemanticError &) {
+    return false; // raise it at eval time instead
+  }
+}
+
+} // namespace
+
+Node fold_constants(Ast & ast, const Node & root){
+  if (!foldable(root)) return root;
+
+  // a node whose tail is being folded, and where the folded tail
+  // starts on the done stack
+  struct Frame {
+    Node node;
+    std::uint32_t next;
+    std::size_t mark;
+  };
+  // the explicit stack keeps deeply nested programs off the native one
+  std::vector<Frame> stack;
+  std::vector<Node> done;
+  stack.push_back({root, 0, 0});
+
+  for (;;) {
+    Frame & top = stack.back();
+    if (top.next < top.node.count) {
+      std::uint32_t i = top.next++;
+      Node child = ast[top.node.first + i];
+      if (evaluates(top.node, i) && foldable(child)) {
+        stack.push_back({child, 0, done.size()});
+      } else {
+        done.push_back(child);
+      }
+      continue;
+    }
+
+    Node folded = top.node;
+    std::size_t mark = top.mark;
+    const Node * tail = done.data() + mark;
+    if (!fold_node(top.node, tail, folded)) {
+      bool changed = false;
+      for (std::uint32_t i = 0; i < folded.count && !changed; i++) {
+        changed = tail[i] != ast[folded.first + i];
+      }
+      // a rewritten tail gets a block of its own, the old one may be shared
+      if (changed) folded.first = ast.append(tail, folded.count);
+    }
+    done.resize(mark);
+    stack.pop_back();
+
+    if (stack.empty()) return folded;
+    done.push_back(folded);
+  }
+}
@@ -0,0 +1,21 @@
+#ifndef FOLD_HPP
+#define FOLD_HPP
+
+// module includes
+#include "ast.hpp"
+
+// fold_constants rewrites the program rooted at root, which is not yet
+// in ast, and returns the new root. Calls to builtins whose arguments
+// are all constants become their result, builtin constants such as pi
+// become values, and an if with a constant boolean condition becomes
+// the branch it takes. Only nodes the evaluator would evaluate are
+// touched, so quoted lists and define names are left as written.
+//
+// A call that would raise an error is left alone so that it fails at
+// eval time, in the same order as before. Blocks that change are
+// appended anew instead of being rewritten, which keeps subtrees that
+// hash consing shares with quoted lists intact. Ast::compact drops the
+// blocks they replace once the root is set.
+Node fold_constants(Ast & ast, const Node & root);
+
+#endif
@@ -5,13 +5,15 @@
 #include <stdexcept>
 #include <iostream>
 #include <exception>
-#include <functional>
+#include <iterator>
 
 // module includes
 #include "tokenize.hpp"
 #include "expression.hpp"
 #include "environment.hpp"
+#include "fold.hpp"
 #include "interpreter_semantic_error.hpp"
+#include "vm.hpp"
 
 class InterpreterParseError: public std::runtime_error {
 public:
@@ -19,42 +21,63 @@ public:
 };
 
 bool Interpreter::parse(std::istream & expression) noexcept{
+  // slurp the stream so the tokenizer can work on a contiguous buffer
+  std::string source;
+  try {
+    source.assign(std::istreambuf_iterator<char>(expression),
+                  std::istreambuf_iterator<char>());
+  } catch (const std::exception &e) {
+    std::cout << "Parse error: " << e.what() << std::endl;
+    return false;
+  }
+  return parse(std::string_view(source));
+}
+
+bool Interpreter::parse(std::string_view source) noexcept{
   // return true if input is valid. otherwise, return false.
-  TokenSequenceType tokens = tokenize(expression);
+  TokenViewSequenceType tokens = tokenize_view(source);
 
   // in case of empty program
   if (tokens.empty()) {
     //std::cout << "no tokens\n";
     return false;
   } else {
-    auto it = tokens.begin();
-    auto inc_it = [&]() -> bool {
-      if (it == tokens.end()) {
-        throw InterpreterParseError("truncated program");
-        return false;
-      }
-      it++;
-      return true;
-    };
-    auto read_it = [&]() -> std::string& {
-      if (it == tokens.end()) {
-        throw InterpreterParseError("truncated program");
-      }
-      return *it;
-    };
+    TokenCursor cursor(source, tokens);
+    // every token other than a parenthesis becomes exactly one node
+    std::size_t atoms = 0;
+    for (const auto & tok : tokens) {
+      atoms += !(tok.length == 1 && (source[tok.offset] == OPEN || source[tok.offset] == CLOSE));
+    }
+    Ast ast(hash_cons);
+    // holds only the children of open lists, so it grows with nesting
+    std::vector<Node> pending;
+    bool single = false;
     try {
-      ast = parse_top_down(it, read_it, inc_it);
-      if (it != tokens.end()) throw InterpreterParseError("unclosed program");
+      ast.reserve(atoms);
+      Node root = parse_top_down(cursor, ast, pending);
+      if (!cursor.done()) throw InterpreterParseError("unclosed program");
+      // judged on the program as written, before folding rewrites it
+      single = root.head.type == SymbolType && root.count == 0
+        && !Environment::find_builtin(root.head.value.sym_value);
+      std::size_t parsed = ast.size();
+      if (fold) root = fold_constants(ast, root);
+      ast.set_root(root);
+      if (ast.size() != parsed + 1) {
+        // folding appended the blocks it rewrote after the ones they replace
+        ast.compact();
+      } else if (hash_cons) {
+        // the arena was sized for every node, sharing leaves it oversized
+        ast.shrink_to_fit();
+      }
     } catch (const InterpreterParseError &e) {
       std::cout << "Parse error: " << e.what() << std::endl;
       return false;
     }
-    //std::cout << "ast: " << ast << std::endl;
+    // closures made by the previous program keep it alive
+    program = std::make_shared<const Program>(std::move(ast));
+    if (engine == BytecodeEngine) program->chunk();
     // fit single symbol case
-    //std::cout << Expression(ast.head.value.sym_value) << std::endl;
-    EnvResult _;
-    if (ast == Expression(ast.head.value.sym_value)
-        && !Environment().lookup(ast.head.value.sym_value, _)) {
+    if (single) {
       std::cout << "Parse error: single non-keyword" << std::endl;
       return false;
     }
@@ -64,81 +87,297 @@ bool Interpreter::parse(std::istream & expression) noexcept{
 };
 
 Expression Interpreter::eval(){
-  return eval_top_down(ast);
+  if (!program || program->ast.empty()) return Expression();
+  if (engine == BytecodeEngine) return vm.run(program, env);
+  running = program;
+  caches = node_caches.of(running, running->ast.size());
+  frame.reset();
+  arg_stack.clear(); // arguments left by an error
+  return eval_top_down(program->ast.root());
 }
 
-Expression Interpreter::parse_top_down(const TokenSequenceType::iterator & it,
-                                        std::function<std::string&(void)> read,
-                                        std::function<bool()> inc) {
-  Expression exp;
-  if (read() != "(") { // atom without parenthesis
-    if (!token_to_atom(read(), exp.head)) throw InterpreterParseError("failed to parse token: " + read());
-  } else { // (...), *it == "("
-    if (!inc()) return Expression();
-    if (read() == ")") { // special case: none
-      //exp.head.type = NoneType;
-      // this case can be treated invalid
-      throw InterpreterParseError("empty application");
-    } else {
+Node Interpreter::parse_top_down(TokenCursor & cursor, Ast & ast, std::vector<Node> & pending) {
+  // an open list: its node so far and where its children start on pending
+  struct Frame {
+    Node node;
+    std::size_t mark;
+  };
+  std::vector<Frame> stack;
+  // the parameters of the lambdas being read, innermost last, and the
+  // stack entry of the lambda each belongs to
+  struct Scope {
+    std::size_t owner;
+    std::vector<Symbol> params;
+  };
+  std::vector<Scope> scopes;
+
+  auto read = [&]() -> std::string_view {
+    if (cursor.done()) throw InterpreterParseError("truncated program");
+    return cursor.peek();
+  };
+  auto read_atom = [&](Node & node) {
+    node = Node{Atom(), 0, 0, OpValue};
+    if (!token_to_atom(read(), node.head)) throw InterpreterParseError("failed to parse token: " + std::string(read()));
+    node.op = opcode_of(node.head);
+    cursor.next();
+    if (node.op != OpSymbol && node.op != OpAnd && node.op != OpOr) return;
+    // a parameter becomes a (depth, slot) address, so that eval reads it
+    // from the call frames without any lookup by name
+    for (std::size_t depth = 0; depth < scopes.size(); depth++) {
+      const auto & params = scopes[scopes.size() - 1 - depth].params;
+      for (std::size_t slot = 0; slot < params.size(); slot++) {
+        if (params[slot] != node.head.value.sym_value) continue;
+        if (depth > UINT16_MAX) throw InterpreterParseError("lambdas nested too deeply");
+        node.op = OpLocal;
+        node.depth = static_cast<std::uint16_t>(depth);
+        node.slot = static_cast<std::uint16_t>(slot);
+        return;
+      }
+    }
+  };
+
+  // nesting lives on the explicit stack, so depth is bounded by memory,
+  // not by the native call stack
+  for (;;) {
+    Node node;
+    if (!stack.empty() && read() == ")") { // close the innermost list
+      Frame & top = stack.back();
+      node = top.node;
+      // children collected on the pending stack move into the
+      // arena as one contiguous block
+      node.count = static_cast<std::uint32_t>(pending.size() - top.mark);
+      node.first = ast.append(pending.data() + top.mark, node.count);
+      pending.resize(top.mark);
+      if (!scopes.empty() && scopes.back().owner == stack.size() - 1) scopes.pop_back();
+      stack.pop_back();
+      cursor.next();
+    } else if (read() == "(") {
+      cursor.next();
+      if (read() == ")") { // special case: none
+        // this case can be treated invalid
+        throw InterpreterParseError("empty application");
+      }
       // assert first is atom due to its syntax
-      if (!token_to_atom(read(), exp.head)) throw InterpreterParseError("failed to parse token: " + read());
+      read_atom(node);
+      stack.push_back({node, pending.size()});
+      continue;
+    } else { // atom without parenthesis
+      read_atom(node);
+    }
+
+    if (stack.empty()) return node;
+    pending.push_back(node);
 
-      if (!inc()) return Expression();
-      while (read() != ")") {
-        exp.tail.push_back(parse_top_down(it, read, inc));
+    // the parameters of a lambda are in scope for the rest of it
+    Frame & top = stack.back();
+    if (top.node.op == OpLambda && pending.size() - top.mark == 1) {
+      int arity = lambda_arity(ast, node);
+      if (arity > UINT16_MAX + 1) throw InterpreterParseError("too many lambda parameters");
+      if (arity > 0) {
+        Scope scope{stack.size() - 1, {}};
+        scope.params.reserve(arity);
+        for (int i = 0; i < arity; i++) {
+          scope.params.push_back(lambda_param(ast, node, i));
+        }
+        scopes.push_back(std::move(scope));
       }
     }
   }
-  if (!inc()) return Expression();
-  return exp;
 }
 
-Expression Interpreter::eval_top_down(const Expression & exp) {
-  EnvResult envres;
-  if (exp.head.type == KeywordType) {
-    if (exp.head.value.sym_value == "begin") {
-      Expression r; // result
-      for (auto a : exp.tail) {
-        r = eval_top_down(a);
+Atom Interpreter::eval_head(Ast::Index index) {
+  // only the head is needed, so a variable reference reads it straight
+  // from its binding instead of copying the bound expression
+  const Node & exp = running->ast[index];
+  if (exp.op == OpSymbol) {
+    const EnvResult * binding = env.find(exp.head.value.sym_value, &caches[index]);
+    if (binding && binding->type == ExpressionType
+        && (exp.count == 0 || binding->exp.head.type != LambdaType)) {
+      return binding->exp.head;
+    }
+  }
+  if (exp.op == OpLocal && exp.count == 0) return env.local(frame.get(), exp.depth, exp.slot).head;
+  return eval_top_down(index).head;
+}
+
+Expression Interpreter::eval_top_down(Ast::Index index) {
+  // Tail positions loop here instead of recursing: a call switches to
+  // the callee's program and frame in place, so a loop written as tail
+  // recursion runs in constant native stack. The caller's program and
+  // frame are given back on the way out, error or not.
+  struct Resume {
+    explicit Resume(Interpreter & self): self(self) {}
+    Interpreter & self;
+    bool saved = false;
+    std::shared_ptr<const Program> running;
+    BindingCache * caches = nullptr;
+    std::shared_ptr<Frame> frame;
+    ~Resume() {
+      if (!saved) return;
+      self.running = std::move(running);
+      self.caches = caches;
+      self.frame = std::move(frame);
+    }
+  } resume{*this};
+  // callee is a copy, which keeps the closure alive should evaluating
+  // the arguments assign over the binding it came from
+  auto enter = [&](Atom callee, const Node & call) {
+    const Closure & closure = *callee.value.closure_value;
+    if (call.count != closure.arity) throw InterpreterSemanticError("incorrect number of args");
+    std::size_t base = arg_stack.size();
+    for (Ast::Index a = call.first; a < call.first + call.count; a++) {
+      arg_stack.push_back(eval_top_down(a));
+    }
+    if (!resume.saved) {
+      resume.running = std::move(running);
+      resume.caches = caches;
+      resume.frame = std::move(frame);
+      resume.saved = true;
+    }
+    // a frame made by an earlier call in this loop that no closure
+    // captured is free to take the arguments of the next one
+    if (frame.use_count() != 1) frame = std::make_shared<Frame>();
+    frame->parent = closure.frame;
+    frame->slots.assign(std::make_move_iterator(arg_stack.begin() + base),
+                        std::make_move_iterator(arg_stack.end()));
+    arg_stack.resize(base);
+    if (running != closure.program) {
+      running = closure.program;
+      caches = node_caches.of(running, running->ast.size());
+    }
+    index = running->ast[closure.lambda].first + 1;
+  };
+
+  for (;;) {
+    const Ast & ast = running->ast;
+    const Node & exp = ast[index];
+    switch (exp.op)
+    {
+    case OpBegin: {
+      if (exp.count == 0) return Expression();
+      Ast::Index last = exp.first + exp.count - 1;
+      for (Ast::Index a = exp.first; a < last; a++) {
+        eval_top_down(a);
       }
-      return r;
-    } else if (exp.head.value.sym_value == "define") {
-      if (exp.tail.size() != 2) throw InterpreterSemanticError("incorrect define");
-      if (exp.tail[0].head.type != SymbolType) throw InterpreterSemanticError("incorrect define symbol");
-      Expression ret;
-      if (!env.define(exp.tail[0].head.value.sym_value, (ret = eval_top_down(exp.tail[1])))) {
-        throw InterpreterSemanticError("redefining " + exp.tail[0].head.value.sym_value);
+      index = last;
+      continue;
+    }
+
+    case OpDefine: {
+      if (exp.count != 2) throw InterpreterSemanticError("incorrect define");
+      const Node & sym = ast[exp.first];
+      if (sym.head.type != SymbolType) throw InterpreterSemanticError("incorrect define symbol");
+      Symbol name = sym.head.value.sym_value;
+      // the value moves into its binding, and the result is copied back
+      // out of it, so a define costs one copy of the tree rather than two
+      if (!env.define(name, eval_top_down(exp.first + 1))) {
+        throw InterpreterSemanticError("redefining " + name.name());
       };
-      return ret;
-    } else if (exp.head.value.sym_value == "if") {
-      if (exp.tail.size() != 3) throw InterpreterSemanticError("incorrect if");
-      auto cond = eval_top_down(exp.tail[0]);
-      if (cond.head.type != BooleanType) throw InterpreterSemanticError("incorrect cond type");
-      if (cond.head.value.bool_value) {
-        return eval_top_down(exp.tail[1]);
+      return env.find(name)->exp;
+    }
+
+    case OpIf: {
+      if (exp.count != 3) throw InterpreterSemanticError("incorrect if");
+      Atom cond = eval_head(exp.first);
+      if (cond.type != BooleanType) throw InterpreterSemanticError("incorrect cond type");
+      index = cond.value.bool_value ? exp.first + 1 : exp.first + 2;
+      continue;
+    }
+
+    case OpKeyword:
+      throw InterpreterSemanticError("unexpected keyword");
+
+    case OpWhile:
+      if (exp.count < 1) throw InterpreterSemanticError("incorrect while");
+      for (;;) {
+        Atom cond = eval_head(exp.first);
+        if (cond.type != BooleanType) throw InterpreterSemanticError("incorrect cond type");
+        if (!cond.value.bool_value) return Expression();
+        for (Ast::Index a = exp.first + 1; a < exp.first + exp.count; a++) {
+          eval_top_down(a);
+        }
+      }
+
+    case OpSet: {
+      if (exp.count != 2) throw InterpreterSemanticError("incorrect set!");
+      const Node & sym = ast[exp.first];
+      if (sym.head.type != SymbolType) throw InterpreterSemanticError("incorrect set! symbol");
+      Expression value = eval_top_down(exp.first + 1);
+      Expression * target;
+      if (sym.op == OpLocal) {
+        target = &env.assignable_local(frame.get(), sym.depth, sym.slot);
       } else {
-        return eval_top_down(exp.tail[2]);
+        Symbol name = sym.head.value.sym_value;
+        if (Environment::find_builtin(name)) throw InterpreterSemanticError("setting builtin " + name.name());
+        target = env.assignable(name);
+        if (!target) throw InterpreterSemanticError("unbound symbol");
       }
-    } else {
-      throw InterpreterSemanticError("unexpected keyword");
+      // assigned in place, a number costs no allocation
+      *target = std::move(value);
+      return *target;
     }
-  } else if (exp.head.type == SymbolType) {
-    if (env.lookup(exp.head.value.sym_value, envres)) {
-      if (envres.type == ProcedureType) {
-        // 1. eval all args, retrieve their head as atom
-        std::vector<Atom> args;
-        for (auto a : exp.tail) {
-          args.push_back(eval_top_down(a).head);
+
+    case OpAnd:
+    case OpOr: {
+      // evaluate left to right and stop at the first argument that decides
+      // the result. Later arguments are never evaluated, so their errors,
+      // type errors included, are not reported.
+      Boolean decides = exp.op == OpOr;
+      for (Ast::Index a = exp.first; a < exp.first + exp.count; a++) {
+        Atom arg = eval_head(a);
+        if (arg.type != BooleanType) throw InterpreterSemanticError("incorrect arg type");
+        if (arg.value.bool_value == decides) return Expression(decides);
+      }
+      return Expression(!decides);
+    }
+
+    case OpSymbol:
+      // the node's inline cache skips the lookup while it holds
+      if (const EnvResult * envres = env.find(exp.head.value.sym_value, &caches[index])) {
+        if (envres->type == ProcedureType) {
+          // 1. eval all args, retrieve their head as atom
+          // short calls keep their arguments on this frame
+          Atom inline_args[MAX_INLINE_ARGS];
+          std::vector<Atom> spilled;
+          Atom * args = inline_args;
+          if (exp.count > MAX_INLINE_ARGS) {
+            spilled.resize(exp.count);
+            args = spilled.data();
+          }
+          for (std::uint32_t i = 0; i < exp.count; i++) {
+            args[i] = eval_head(exp.first + i);
+          }
+          // 2. apply
+          return envres->proc(Args(args, exp.count));
+        } else if (envres->exp.head.type == LambdaType && exp.count > 0) {
+          enter(envres->exp.head, exp);
+          continue;
+        } else {
+          return envres->exp;
         }
-        // 2. apply
-        return envres.proc(args);
-      } else {
-        return envres.exp;
+      } else { // unbound
+        throw InterpreterSemanticError("unbound symbol");
+      }
+
+    case OpLambda: {
+      if (exp.count != 2) throw InterpreterSemanticError("incorrect lambda");
+      int arity = lambda_arity(ast, ast[exp.first]);
+      if (arity < 0) throw InterpreterSemanticError("incorrect lambda parameters");
+      return Expression(make_closure(running, index, static_cast<std::uint32_t>(arity), frame));
+    }
+
+    case OpLocal: {
+      const Expression & value = env.local(frame.get(), exp.depth, exp.slot);
+      if (value.head.type == LambdaType && exp.count > 0) {
+        enter(value.head, exp);
+        continue;
       }
-    } else { // unbound
-      throw InterpreterSemanticError("unbound symbol");
+      return value;
+    }
+
+    case OpValue:
+      if (exp.count == 0) return Expression(exp.head);
+      return ast.to_expression(index);
     }
   }
-  // otherwise value
-  return exp;
-}
\ No newline at end of file
+}
@@ -2,15 +2,25 @@
 #define INTERPRETER_HPP
 
 // system includes
+#include <memory>
 #include <string>
+#include <string_view>
 #include <istream>
-#include <functional>
+#include <vector>
 
 
 // module includes
 #include "expression.hpp"
 #include "environment.hpp"
 #include "tokenize.hpp"
+#include "ast.hpp"
+#include "bytecode.hpp"
+#include "program.hpp"
+#include "vm.hpp"
+
+// Engine selects how eval runs the parsed program:
+// by walking the AST, or by compiling it to bytecode for the VM
+enum Engine {TreeEngine, BytecodeEngine};
 
 // Interpreter has
 // Environment, which starts at a default
@@ -18,13 +28,44 @@
 // eval method, updates Environment, returns last result
 class Interpreter{
 public:
+  explicit Interpreter(Engine engine = TreeEngine): engine(engine) {};
+  // fork from a snapshot of another Interpreter's definitions, in O(1).
+  // Defines made by the fork stay private to it.
+  explicit Interpreter(const Environment::Snapshot & base, Engine engine = TreeEngine):
+    engine(engine), env(base) {};
+
+  // freeze the definitions made so far for use by forks
+  Environment::Snapshot snapshot() { return env.snapshot(); }
+
+  // store repeated subexpressions of later parsed programs only once
+  void set_hash_consing(bool on) noexcept { hash_cons = on; }
+
+  // fold constant subexpressions of later parsed programs, on by default.
+  // Turn it off to evaluate programs exactly as written when debugging.
+  void set_constant_folding(bool on) noexcept { fold = on; }
+
   bool parse(std::istream & expression) noexcept;
+  bool parse(std::string_view source) noexcept;
   Expression eval();
 private:
+  Engine engine;
+  bool hash_cons = false;
+  bool fold = true;
   Environment env;
-  Expression ast;
-  static Expression parse_top_down(const TokenSequenceType::iterator&, std::function<std::string&(void)>, std::function<bool()>);
-  Expression eval_top_down(const Expression&);
+  std::shared_ptr<const Program> program; // the last parsed program
+  VM vm;
+  // where the tree walker is: the program of the closure being run,
+  // and the frame of its call
+  std::shared_ptr<const Program> running;
+  std::shared_ptr<Frame> frame;
+  // the inline caches of each program run, and those of running
+  BindingCaches node_caches;
+  BindingCache * caches = nullptr;
+  // arguments of the closure calls being evaluated
+  std::vector<Expression> arg_stack;
+  static Node parse_top_down(TokenCursor&, Ast&, std::vector<Node>&);
+  Expression eval_top_down(Ast::Index);
+  Atom eval_head(Ast::Index);
 };
 
 
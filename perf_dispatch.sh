@@ -0,0 +1,16 @@
+#!/bin/sh
+# Compare the VM's switch dispatch with its direct-threaded code: runs
+# bench_vm and bench_vm_threaded on the VM only under perf stat, which
+# reports branch mispredictions alongside instructions and time.
+#   usage: sh perf_dispatch.sh [forms]   from the source root
+# The Release build goes to $BUILD, outside the source tree by default.
+set -e
+build=${BUILD:-${TMPDIR:-/tmp}/slisp_bench}
+forms=${1:-100000}
+cmake -S . -B $build -DCMAKE_BUILD_TYPE=Release > /dev/null
+cmake --build $build --target bench_vm bench_vm_threaded > /dev/null
+for bench in bench_vm bench_vm_threaded
+do
+    echo "== $bench"
+    perf stat -e task-clock,instructions,branches,branch-misses $build/$bench $forms vm
+done
@@ -0,0 +1,45 @@
+#include "program.hpp"
+
+const Chunk & Program::chunk() const{
+  // forks of one snapshot may share a program between threads
+  std::call_once(compiled, [this] { code = compile(ast); });
+  return code;
+}
+
+const Chunk & Program::linked_chunk(const void * const * handlers) const{
+  chunk();
+  std::call_once(linked, [&] {
+    for (Instr & instr : code.code) instr.handler = handlers[instr.op];
+  });
+  return code;
+}
+
+BindingCache * BindingCaches::of(const std::shared_ptr<const Program> & program, std::size_t count){
+  Entry & entry = entries[program.get()];
+  if (entry.program.expired()) {
+    // new, or left by a freed program at the same address
+    entry.program = program;
+    entry.caches.assign(count, BindingCache());
+    // drop the entries of freed programs whenever the count has doubled
+    if (entries.size() > 2 * swept) {
+      for (auto it = entries.begin(); it != entries.end();) {
+        it = it->second.program.expired() ? entries.erase(it) : std::next(it);
+      }
+      swept = entries.size();
+    }
+  }
+  return entry.caches.data();
+}
+
+void retain(const Closure * closure) noexcept{
+  closure->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void release(const Closure * closure) noexcept{
+  if (closure->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) delete closure;
+}
+
+Atom make_closure(std::shared_ptr<const Program> program, Ast::Index lambda,
+                  std::uint32_t arity, std::shared_ptr<Frame> frame){
+  return Atom(new Closure{std::move(program), lambda, arity, std::move(frame)});
+}
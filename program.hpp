@@ -0,0 +1,97 @@
+#ifndef PROGRAM_HPP
+#define PROGRAM_HPP
+
+// system includes
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// module includes
+#include "ast.hpp"
+#include "bytecode.hpp"
+#include "expression.hpp"
+
+struct EnvResult;
+class Program;
+
+// A BindingCache remembers the binding a global symbol resolved to. It
+// is valid while the environment's epoch is the one it was filled at.
+struct BindingCache{
+  std::uint64_t epoch = 0;
+  const EnvResult * binding = nullptr;
+};
+
+// BindingCaches holds the inline caches of one evaluator, a tree walker
+// or a VM, for each program it runs. Programs are shared with snapshot
+// forks, possibly across threads, so every evaluator fills caches of
+// its own and a cache is checked by the epoch alone.
+class BindingCaches{
+public:
+  // count caches for program, empty when it is first run
+  BindingCache * of(const std::shared_ptr<const Program> & program, std::size_t count);
+
+private:
+  struct Entry{
+    // expired once the program is freed and its address can be reused
+    std::weak_ptr<const Program> program;
+    std::vector<BindingCache> caches;
+  };
+  std::unordered_map<const Program *, Entry> entries;
+  // how many entries there were after freed programs were last dropped
+  std::size_t swept = 0;
+};
+
+// A Program is one parsed program. Closures made while running it keep
+// it alive, so their code outlives the next parse.
+class Program{
+public:
+  explicit Program(Ast ast): ast(std::move(ast)) {};
+
+  const Ast ast;
+
+  // the program compiled for the VM, compiled on first use. Closures
+  // made by the tree walker can be called from a VM, and vice versa.
+  const Chunk & chunk() const;
+  // the chunk with the handler of each instruction taken from handlers,
+  // indexed by VmOp, for a VM that jumps from one handler straight to
+  // the next. Linked once, on first use.
+  const Chunk & linked_chunk(const void * const * handlers) const;
+
+private:
+  mutable std::once_flag compiled;
+  mutable std::once_flag linked;
+  mutable Chunk code;
+};
+
+// A Frame holds the arguments of one lambda call. It links to the
+// frame the lambda was made in, which is depth 1 from inside the call.
+// Its slots are read and assigned through an Environment, see
+// Environment::local.
+struct Frame{
+  std::shared_ptr<Frame> parent;
+  std::vector<Expression> slots;
+  // set once a snapshot can reach the frame, after which it is shared
+  // with forks and never assigned in place
+  bool frozen = false;
+};
+
+// A Closure is a lambda node of a program together with the frame it
+// was made in. It is freed with the last LambdaType Atom holding it.
+struct Closure{
+  std::shared_ptr<const Program> program;
+  Ast::Index lambda;
+  std::uint32_t arity;
+  std::shared_ptr<Frame> frame;
+  // LambdaType Atoms holding it, which may be on different threads
+  mutable std::atomic<std::size_t> refs{0};
+};
+
+// make a closure, held by the Atom returned
+Atom make_closure(std::shared_ptr<const Program> program, Ast::Index lambda,
+                  std::uint32_t arity, std::shared_ptr<Frame> frame);
+
+#endif
@@ -0,0 +1,169 @@
+#include "scan.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+#define SCAN_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(SCAN_HAVE_SSE2) && (defined(__GNUC__) || defined(__clang__))
+#define SCAN_HAVE_AVX2 1
+#include <immintrin.h>
+#define SCAN_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace {
+
+inline bool is_delimiter(char c) {
+  switch (c)
+  {
+  case '(':
+  case ')':
+  case ';':
+  case ' ':
+  case '\t':
+  case '\r':
+  case '\n':
+    return true;
+  default:
+    return false;
+  }
+}
+
+inline unsigned lowest_bit(unsigned mask) {
+#ifdef _MSC_VER
+  unsigned long idx;
+  _BitScanForward(&idx, mask);
+  return idx;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+
+std::size_t scalar_find_delimiter(const char * src, std::size_t pos, std::size_t size) {
+  while (pos < size && !is_delimiter(src[pos])) pos++;
+  return pos;
+}
+
+std::size_t scalar_find_newline(const char * src, std::size_t pos, std::size_t size) {
+  while (pos < size && src[pos] != '\n') pos++;
+  return pos;
+}
+
+#ifdef SCAN_HAVE_SSE2
+
+inline unsigned sse2_delimiter_mask(const char * p) {
+  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+  __m128i m = _mm_or_si128(
+    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('(')),
+                 _mm_cmpeq_epi8(v, _mm_set1_epi8(')'))),
+    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(';')),
+                 _mm_cmpeq_epi8(v, _mm_set1_epi8(' '))));
+  m = _mm_or_si128(m, _mm_or_si128(
+    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')),
+                 _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))),
+    _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))));
+  return static_cast<unsigned>(_mm_movemask_epi8(m));
+}
+
+std::size_t sse2_find_delimiter(const char * src, std::size_t pos, std::size_t size) {
+  for (; pos + 16 <= size; pos += 16) {
+    unsigned mask = sse2_delimiter_mask(src + pos);
+    if (mask) return pos + lowest_bit(mask);
+  }
+  return scalar_find_delimiter(src, pos, size);
+}
+
+std::size_t sse2_find_newline(const char * src, std::size_t pos, std::size_t size) {
+  const __m128i nl = _mm_set1_epi8('\n');
+  for (; pos + 16 <= size; pos += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + pos));
+    unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+    if (mask) return pos + lowest_bit(mask);
+  }
+  return scalar_find_newline(src, pos, size);
+}
+
+#endif
+
+#ifdef SCAN_HAVE_AVX2
+
+SCAN_TARGET_AVX2 inline unsigned avx2_delimiter_mask(const char * p) {
+  __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+  __m256i m = _mm256_or_si256(
+    _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('(')),
+                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8(')'))),
+    _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(';')),
+                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '))));
+  m = _mm256_or_si256(m, _mm256_or_si256(
+    _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')),
+                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))),
+    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))));
+  return static_cast<unsigned>(_mm256_movemask_epi8(m));
+}
+
+SCAN_TARGET_AVX2 std::size_t avx2_find_delimiter(const char * src, std::size_t pos, std::size_t size) {
+  for (; pos + 32 <= size; pos += 32) {
+    unsigned mask = avx2_delimiter_mask(src + pos);
+    if (mask) return pos + lowest_bit(mask);
+  }
+  return sse2_find_delimiter(src, pos, size);
+}
+
+SCAN_TARGET_AVX2 std::size_t avx2_find_newline(const char * src, std::size_t pos, std::size_t size) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  for (; pos + 32 <= size; pos += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + pos));
+    unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl)));
+    if (mask) return pos + lowest_bit(mask);
+  }
+  return sse2_find_newline(src, pos, size);
+}
+
+#endif
+
+} // namespace
+
+bool scan_mode_supported(ScanMode mode) noexcept{
+  switch (mode)
+  {
+  case ScanAuto:
+  case ScanScalar:
+    return true;
+#ifdef SCAN_HAVE_SSE2
+  case ScanSSE2:
+    return true;
+#endif
+#ifdef SCAN_HAVE_AVX2
+  case ScanAVX2:
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    return has_avx2;
+#endif
+  default:
+    return false;
+  }
+}
+
+Scanner get_scanner(ScanMode mode) noexcept{
+  if (mode == ScanAuto || !scan_mode_supported(mode)) {
+    if (scan_mode_supported(ScanAVX2)) mode = ScanAVX2;
+    else if (scan_mode_supported(ScanSSE2)) mode = ScanSSE2;
+    else mode = ScanScalar;
+  }
+  switch (mode)
+  {
+#ifdef SCAN_HAVE_AVX2
+  case ScanAVX2:
+    return {avx2_find_delimiter, avx2_find_newline};
+#endif
+#ifdef SCAN_HAVE_SSE2
+  case ScanSSE2:
+    return {sse2_find_delimiter, sse2_find_newline};
+#endif
+  default:
+    return {scalar_find_delimiter, scalar_find_newline};
+  }
+}
@@ -0,0 +1,27 @@
+#ifndef SCAN_HPP
+#define SCAN_HPP
+
+// system includes
+#include <cstddef>
+
+// Delimiter scanners used by the tokenizer to skip over atoms and
+// comment bodies in bulk. The vector versions classify 16 (SSE2) or
+// 32 (AVX2) bytes per step; ScanAuto picks the widest one the CPU supports.
+enum ScanMode {ScanAuto, ScanScalar, ScanSSE2, ScanAVX2};
+
+struct Scanner {
+  // index of the first structural byte ('(' ')' ';' or whitespace)
+  // in src[pos, size), or size if there is none
+  std::size_t (*find_delimiter)(const char * src, std::size_t pos, std::size_t size);
+  // index of the first '\n' in src[pos, size), or size if there is none
+  std::size_t (*find_newline)(const char * src, std::size_t pos, std::size_t size);
+};
+
+// true if mode can run on this build and CPU
+bool scan_mode_supported(ScanMode mode) noexcept;
+
+// the scanner for mode, ScanAuto or an unsupported mode resolve to
+// the best supported one
+Scanner get_scanner(ScanMode mode = ScanAuto) noexcept;
+
+#endif
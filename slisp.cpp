@@ -2,7 +2,7 @@
 #include <iostream>
 #include <sstream>
 #include <cstring>
-#include <fstream>
+#include "source_file.hpp"
 #include "tokenize.hpp"
 #include "expression.hpp"
 #include "interpreter.hpp"
@@ -10,8 +10,8 @@
 
 int main(int argc, char **argv)
 {
-  auto parse_and_eval = [](Interpreter &interpreter, std::istream &is) {
-    if (!interpreter.parse(is)) return;
+  auto parse_and_eval = [](Interpreter &interpreter, auto &&input) {
+    if (!interpreter.parse(input)) return;
     try {
       std::cout << interpreter.eval() << std::endl;
     } catch (const InterpreterSemanticError &e) {
@@ -19,7 +19,14 @@ int main(int argc, char **argv)
     }
   };
 
-  Interpreter interpreter;
+  Engine engine = TreeEngine;
+  if (argc > 1 && !strcmp(argv[1], "--vm")) { // run on the bytecode VM
+    engine = BytecodeEngine;
+    argc--;
+    argv++;
+  }
+
+  Interpreter interpreter(engine);
   if (argc == 1) { // repl
     std::string line;
     while (std::getline(std::cin, line)) {
@@ -30,10 +37,12 @@ int main(int argc, char **argv)
     std::istringstream is(argv[2]);
     parse_and_eval(interpreter, is);
   } else if (argc == 2) {
-    std::ifstream ifs;
-    ifs.open(argv[1]);
-    parse_and_eval(interpreter, ifs);
-    ifs.close();
+    SourceFile source;
+    if (!source.load(argv[1])) {
+      std::cout << "Error: could not read " << argv[1] << std::endl;
+      return EXIT_FAILURE;
+    }
+    parse_and_eval(interpreter, source.text());
   } else {
     return EXIT_FAILURE;
   }
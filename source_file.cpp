@@ -0,0 +1,85 @@
+#include "source_file.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SOURCE_FILE_POSIX 1
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <fstream>
+#include <iterator>
+#endif
+
+SourceFile::~SourceFile(){
+  release();
+}
+
+void SourceFile::release() noexcept{
+#ifdef SOURCE_FILE_POSIX
+  if (map != nullptr) munmap(map, map_size);
+#endif
+  map = nullptr;
+  map_size = 0;
+  buffer.clear();
+}
+
+std::string_view SourceFile::text() const noexcept{
+  if (map != nullptr) {
+    return std::string_view(static_cast<const char *>(map), map_size);
+  }
+  return buffer;
+}
+
+#ifdef SOURCE_FILE_POSIX
+
+bool SourceFile::load(const std::string & path){
+  release();
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void * p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      map = p;
+      map_size = st.st_size;
+      madvise(map, map_size, MADV_SEQUENTIAL);
+      close(fd);
+      return true;
+    }
+  }
+
+  // not mappable, read everything into the buffer
+  char chunk[1 << 16];
+  for (;;) {
+    ssize_t n = read(fd, chunk, sizeof(chunk));
+    if (n > 0) {
+      buffer.append(chunk, n);
+    } else if (n == 0) {
+      break;
+    } else if (errno != EINTR) {
+      close(fd);
+      buffer.clear();
+      return false;
+    }
+  }
+  close(fd);
+  return true;
+}
+
+#else
+
+bool SourceFile::load(const std::string & path){
+  release();
+
+  std::ifstream ifs(path, std::ios::in | std::ios::binary);
+  if (!ifs.good()) return false;
+  buffer.assign(std::istreambuf_iterator<char>(ifs),
+                std::istreambuf_iterator<char>());
+  return !ifs.bad();
+}
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef SOURCE_FILE_HPP
+#define SOURCE_FILE_HPP
+
+// system includes
+#include <string>
+#include <string_view>
+
+// SourceFile holds the full text of a program file in one contiguous
+// buffer so it can be handed to the tokenizer without stream extraction.
+// Regular files are memory mapped; anything that cannot be mapped
+// (pipes, character devices, empty files) is read into a buffer instead.
+class SourceFile{
+public:
+  SourceFile() = default;
+  ~SourceFile();
+
+  SourceFile(const SourceFile&) = delete;
+  SourceFile& operator=(const SourceFile&) = delete;
+
+  // load the file at path, return false if it cannot be opened or read
+  bool load(const std::string & path);
+
+  // the loaded text, valid until the SourceFile is destroyed or reloaded
+  std::string_view text() const noexcept;
+
+  // true if the text is backed by a memory mapping
+  bool mapped() const noexcept { return map != nullptr; }
+
+private:
+  void release() noexcept;
+
+  void * map = nullptr;
+  std::size_t map_size = 0;
+  std::string buffer;
+};
+
+#endif
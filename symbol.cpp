@@ -0,0 +1,51 @@
+#include "symbol.hpp"
+
+// system includes
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
+namespace {
+
+// names live in a deque so references handed out by name() and the
+// views used as map keys stay valid as the table grows
+struct SymbolTable {
+  std::mutex lock;
+  std::deque<std::string> names;
+  std::unordered_map<std::string_view, std::uint32_t> ids;
+
+  SymbolTable() {
+    names.emplace_back();
+    ids.emplace(names.back(), 0);
+  }
+};
+
+SymbolTable & table(){
+  static SymbolTable t;
+  return t;
+}
+
+} // namespace
+
+Symbol::Symbol(std::string_view name){
+  SymbolTable & t = table();
+  std::lock_guard<std::mutex> guard(t.lock);
+  auto it = t.ids.find(name);
+  if (it != t.ids.end()) {
+    id = it->second;
+    return;
+  }
+  id = static_cast<std::uint32_t>(t.names.size());
+  t.names.emplace_back(name);
+  t.ids.emplace(t.names.back(), id);
+}
+
+const std::string & Symbol::name() const{
+  SymbolTable & t = table();
+  std::lock_guard<std::mutex> guard(t.lock);
+  return t.names[id];
+}
+
+std::ostream & operator<<(std::ostream & out, Symbol sym){
+  return out << sym.name();
+}
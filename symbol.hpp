@@ -0,0 +1,43 @@
+#ifndef SYMBOL_HPP
+#define SYMBOL_HPP
+
+// system includes
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+// A Symbol is an interned name: a small integer id into a process-wide
+// table. Symbols compare and hash by id, the text is only needed for
+// printing. Constructing a Symbol from text interns it, so equal names
+// always get equal ids. The default Symbol is the empty name.
+class Symbol{
+public:
+  Symbol() noexcept: id(0) {};
+  Symbol(std::string_view name);
+  Symbol(const std::string & name): Symbol(std::string_view(name)) {};
+  Symbol(const char * name): Symbol(std::string_view(name)) {};
+
+  // the interned text, valid for the life of the process
+  const std::string & name() const;
+
+  std::uint32_t index() const noexcept { return id; }
+
+  friend bool operator==(Symbol a, Symbol b) noexcept { return a.id == b.id; }
+  friend bool operator!=(Symbol a, Symbol b) noexcept { return a.id != b.id; }
+  friend bool operator<(Symbol a, Symbol b) noexcept { return a.id < b.id; }
+
+private:
+  std::uint32_t id;
+};
+
+std::ostream & operator<<(std::ostream & out, Symbol sym);
+
+namespace std {
+template <> struct hash<Symbol> {
+  std::size_t operator()(Symbol sym) const noexcept { return sym.index(); }
+};
+}
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef SYMBOL_MAP_HPP
+#define SYMBOL_MAP_HPP
+
+// system includes
+#include <cstdint>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+// module includes
+#include "symbol.hpp"
+
+// SymbolMap is an open-addressing hash table from Symbols to values.
+//
+// Slots hold only a precomputed hash and a 1-based index into blocks
+// of (Symbol, V) entries, so probing stays within one cache-friendly
+// array and entries never move once inserted. The hash multiplies the
+// symbol id by an odd constant, which is a bijection on 32 bits, so
+// equal hashes mean equal symbols and no key compare is needed.
+//
+// Nothing is allocated until the first insert. The table doubles when it
+// is half full, migrating the old slots a few
+// at a time on later inserts instead of rehashing everything at once.
+// Entries cannot be erased.
+template <typename V>
+class SymbolMap{
+public:
+  SymbolMap() = default;
+  SymbolMap(SymbolMap &&) = default;
+  SymbolMap & operator=(SymbolMap &&) = default;
+
+  SymbolMap(const SymbolMap & other):
+    slots(other.slots), shift(other.shift), old_slots(other.old_slots),
+    old_shift(other.old_shift), migrated(other.migrated), count(other.count) {
+    // a copied vector may have no spare capacity, so rebuild each block
+    // at full size to keep later inserts from moving entries
+    blocks.reserve(other.blocks.size());
+    for (const auto & b : other.blocks) {
+      blocks.emplace_back();
+      blocks.back().reserve(BLOCK_SIZE);
+      blocks.back().insert(blocks.back().end(), b.begin(), b.end());
+    }
+  }
+
+  SymbolMap & operator=(const SymbolMap & other){
+    if (this != &other) *this = SymbolMap(other);
+    return *this;
+  }
+
+  std::size_t size() const noexcept { return count; }
+
+  // the value for sym, or nullptr
+  V * find(Symbol sym) noexcept{
+    return const_cast<V *>(static_cast<const SymbolMap &>(*this).find(sym));
+  }
+
+  const V * find(Symbol sym) const noexcept{
+    if (slots.empty()) return nullptr;
+    std::uint32_t h = hash(sym);
+    std::uint32_t e = probe(slots, shift, h);
+    if (!e && !old_slots.empty()) e = probe(old_slots, old_shift, h);
+    return e ? &entry(e).second : nullptr;
+  }
+
+  // add sym with value unless it is present, return the stored value
+  // and whether it was inserted
+  std::pair<V *, bool> insert(Symbol sym, V value){
+    if (V * found = find(sym)) return {found, false};
+
+    migrate();
+    if ((count + 1) * 2 > slots.size()) grow();
+
+    if (count % BLOCK_SIZE == 0) {
+      blocks.emplace_back();
+      blocks.back().reserve(BLOCK_SIZE);
+    }
+    blocks.back().emplace_back(sym, std::move(value));
+    count++;
+    place(slots, shift, {hash(sym), static_cast<std::uint32_t>(count)});
+    migrate();
+    return {&blocks.back().back().second, true};
+  }
+
+  // call f(sym, value) for every entry, in insertion order
+  template <typename F>
+  void for_each(F f) const{
+    for (const auto & b : blocks) {
+      for (const auto & e : b) f(e.first, e.second);
+    }
+  }
+
+private:
+  struct Slot{
+    std::uint32_t hash;
+    std::uint32_t entry; // 1-based, 0 when the slot is empty
+  };
+
+  typedef std::pair<Symbol, V> Entry;
+
+  static constexpr unsigned MIN_BITS = 4;
+  static constexpr std::size_t MIN_CAPACITY = std::size_t(1) << MIN_BITS;
+  // old slots moved per insert while a resize is in progress
+  static constexpr std::size_t MIGRATE_STEP = 4;
+  // entries per block; blocks are reserved up front and never reallocate
+  static constexpr std::size_t BLOCK_SIZE = 16;
+
+  const Entry & entry(std::uint32_t e) const noexcept{
+    return blocks[(e - 1) / BLOCK_SIZE][(e - 1) % BLOCK_SIZE];
+  }
+
+  static std::uint32_t hash(Symbol sym) noexcept{
+    return sym.index() * 0x9E3779B1u;
+  }
+
+  // find the entry with hash h, 0 if absent
+  static std::uint32_t probe(const std::vector<Slot> & table, unsigned shift, std::uint32_t h) noexcept{
+    std::size_t mask = table.size() - 1;
+    for (std::size_t i = h >> shift; ; i = (i + 1) & mask) {
+      const Slot & s = table[i];
+      if (s.entry == 0) return 0;
+      if (s.hash == h) return s.entry;
+    }
+  }
+
+  static void place(std::vector<Slot> & table, unsigned shift, Slot slot) noexcept{
+    std::size_t mask = table.size() - 1;
+    std::size_t i = slot.hash >> shift;
+    while (table[i].entry != 0) i = (i + 1) & mask;
+    table[i] = slot;
+  }
+
+  void grow(){
+    if (slots.empty()) {
+      slots.assign(MIN_CAPACITY, Slot{0, 0});
+      shift = 32 - MIN_BITS;
+      return;
+    }
+    // finish any earlier resize before starting the next one
+    while (!old_slots.empty()) migrate();
+    old_slots.swap(slots);
+    old_shift = shift;
+    slots.assign(old_slots.size() * 2, Slot{0, 0});
+    shift--;
+    migrated = 0;
+  }
+
+  void migrate() noexcept{
+    if (old_slots.empty()) return;
+    std::size_t end = std::min(migrated + MIGRATE_STEP, old_slots.size());
+    for (; migrated < end; migrated++) {
+      // an entry stays findable in old_slots until it is placed here
+      if (old_slots[migrated].entry != 0) place(slots, shift, old_slots[migrated]);
+    }
+    if (migrated == old_slots.size()) {
+      std::vector<Slot>().swap(old_slots);
+    }
+  }
+
+  std::vector<std::vector<Entry>> blocks;
+  std::vector<Slot> slots;
+  unsigned shift = 32;
+  // the previous slot array while a resize is in progress
+  std::vector<Slot> old_slots;
+  unsigned old_shift = 0;
+  std::size_t migrated = 0;
+  std::size_t count = 0;
+};
+
+#endif
@@ -0,0 +1,39 @@
+#include "test_alloc.hpp"
+
+#include <cstdlib>
+#include <new>
+
+// the replacements live in their own translation unit so the compiler
+// never inlines them into a caller and pairs malloc with delete
+
+std::size_t allocations = 0;
+std::size_t allocated_bytes = 0;
+std::size_t deallocations = 0;
+
+void * operator new(std::size_t size){
+  allocations++;
+  allocated_bytes += size;
+  if (void * p = std::malloc(size ? size : 1)) return p;
+  throw std::bad_alloc();
+}
+
+void * operator new[](std::size_t size){
+  return operator new(size);
+}
+
+void operator delete(void * p) noexcept{
+  if (p) deallocations++;
+  std::free(p);
+}
+
+void operator delete[](void * p) noexcept{
+  operator delete(p);
+}
+
+void operator delete(void * p, std::size_t) noexcept{
+  operator delete(p);
+}
+
+void operator delete[](void * p, std::size_t) noexcept{
+  operator delete(p);
+}
@@ -0,0 +1,14 @@
+#ifndef TEST_ALLOC_HPP
+#define TEST_ALLOC_HPP
+
+#include <cstddef>
+
+// heap allocations made by the test program so far, counted by the
+// replacement operator new in test_alloc.cpp so tests can check the
+// evaluator's hot paths
+extern std::size_t allocations;
+extern std::size_t allocated_bytes;
+// and how many of them were freed
+extern std::size_t deallocations;
+
+#endif
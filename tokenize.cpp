@@ -2,57 +2,60 @@
 #include <cctype>
 
 #include <iostream>
+#include <iterator>
 #include <string>
 
 TokenSequenceType tokenize(std::istream & seq){
+  std::string src((std::istreambuf_iterator<char>(seq)),
+                  std::istreambuf_iterator<char>());
+
   TokenSequenceType tokens;
+  for (const auto & tok : tokenize_view(src)) {
+    tokens.emplace_back(token_text(src, tok));
+  }
+  return tokens;
+}
 
-  char c;
-  std::string tmp;
-  bool on_atom = false;
+TokenViewSequenceType tokenize_view(std::string_view src, ScanMode mode){
+  TokenViewSequenceType tokens;
+  // programs run from a token every 8 bytes to one every 50 or more
+  // with long names and comments. Views for one every 16 bytes take
+  // as much memory as the source, and denser input grows from there.
+  tokens.reserve(src.size() / 16);
+  const Scanner scanner = get_scanner(mode);
 
-  auto commit_atom_if_leaving = [&]() {
-    if (on_atom) {
-      tokens.push_back(tmp);
-      on_atom = false;
-    }
-  };
+  const char * data = src.data();
+  const std::size_t size = src.size();
+  std::size_t i = 0;
 
-  while (seq.get(c)) {
-    switch (c)
+  while (i < size) {
+    switch (data[i])
     {
     case OPEN:
-      commit_atom_if_leaving();
-      tokens.push_back("(");
-      break;
-
     case CLOSE:
-      commit_atom_if_leaving();
-      tokens.push_back(")");
+      tokens.push_back({i, 1});
+      i++;
       break;
 
     case COMMENT:
-      commit_atom_if_leaving();
-      while (seq.get(c) && c != '\n');
+      // stops on the '\n', which is skipped as whitespace
+      i = scanner.find_newline(data, i + 1, size);
       break;
 
     case ' ':
     case '\t':
     case '\r':
     case '\n':
-      commit_atom_if_leaving();
+      i++;
       break;
 
-    default:
-      if (on_atom) { // continue reading to tmp
-        tmp.push_back(c);
-      } else { // start reading to tmp
-        tmp = c;
-        on_atom = true;
-      }
+    default: { // an atom runs up to the next delimiter
+      std::size_t end = scanner.find_delimiter(data, i + 1, size);
+      tokens.push_back({i, end - i});
+      i = end;
+    }
     }
   }
-  commit_atom_if_leaving();
 
   return tokens;
 }
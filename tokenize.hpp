@@ -3,9 +3,23 @@
 
 #include <istream>
 #include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "scan.hpp"
 
 typedef std::deque<std::string> TokenSequenceType;
 
+// A TokenView locates a token inside the contiguous buffer it was
+// read from, so tokenizing does not allocate per token
+struct TokenView {
+  std::size_t offset;
+  std::size_t length;
+};
+
+typedef std::vector<TokenView> TokenViewSequenceType;
+
 const char OPEN = '(';
 const char CLOSE = ')';
 const char COMMENT = ';';
@@ -15,4 +29,31 @@ const char COMMENT = ';';
 // ignores any whitespace and from any ";" to end-of-line
 TokenSequenceType tokenize(std::istream & seq);
 
+// same as tokenize, but works on a contiguous buffer and
+// returns (offset, length) views into it instead of copies,
+// atoms and comments are skipped with the delimiter scanner for mode
+TokenViewSequenceType tokenize_view(std::string_view src, ScanMode mode = ScanAuto);
+
+// the text of a token view inside the buffer it was produced from
+inline std::string_view token_text(std::string_view src, const TokenView & tok){
+  return src.substr(tok.offset, tok.length);
+}
+
+// TokenCursor walks a token view sequence over the buffer it came from
+class TokenCursor{
+public:
+  TokenCursor(std::string_view src, const TokenViewSequenceType & tokens):
+    src(src), it(tokens.begin()), end(tokens.end()) {};
+
+  bool done() const noexcept { return it == end; }
+  // the current token, only valid while !done()
+  std::string_view peek() const noexcept { return token_text(src, *it); }
+  void next() noexcept { ++it; }
+
+private:
+  std::string_view src;
+  TokenViewSequenceType::const_iterator it;
+  TokenViewSequenceType::const_iterator end;
+};
+
 #endif
@@ -3,10 +3,57 @@
 #include "catch.hpp"
 
 #include "expression.hpp"
+#include "fold.hpp"
 #include "interpreter.hpp"
 #include "interpreter_semantic_error.hpp"
+#include "source_file.hpp"
+#include "symbol_map.hpp"
+#include "test_alloc.hpp"
+#include "test_config.hpp"
 
+#include <cmath>
+#include <cstdio>
+#include <functional>
 #include <sstream>
+#include <thread>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#endif
+
+// a program and what it should print, or "Error: " and the
+// message of the semantic error it raises
+struct Case{
+  const char * program;
+  const char * expected;
+};
+
+// parse and evaluate a program, returning what it prints
+static std::string run(Interpreter & interp, std::string_view program){
+  REQUIRE(interp.parse(program));
+  try {
+    std::ostringstream out;
+    out << interp.eval();
+    return out.str();
+  } catch (const InterpreterSemanticError & e) {
+    return std::string("Error: ") + e.what();
+  }
+}
+
+// run every case on both engines, with and without constant folding
+template <std::size_t N>
+static void check_cases(const Case (&cases)[N]){
+  for (auto engine : {TreeEngine, BytecodeEngine}) {
+    for (bool fold : {false, true}) {
+      for (const auto & c : cases) {
+        Interpreter interp(engine);
+        interp.set_constant_folding(fold);
+        INFO(c.program);
+        REQUIRE(run(interp, c.program) == c.expected);
+      }
+    }
+  }
+}
 
 TEST_CASE ( "Test boolean expression constructor", "[types]" ) {
 
@@ -31,8 +78,8 @@ TEST_CASE ( "Test number expression constructor", "[types]" ) {
 
   Expression exp(42.12);
 
-  REQUIRE(exp.head.type == NumberType);
-  REQUIRE(exp.head.value.num_value == 42.12);
+  REQUIRE(exp.head.type == RealType);
+  REQUIRE(exp.head.value.real_value == 42.12);
   REQUIRE(exp.tail.empty());
 }
 
@@ -189,6 +236,7 @@ TEST_CASE ( "Test apply invalid number of args", "[interpreter]") {
       std::string program = std::string("(") + r.name + ss.str() + std::string(")");
 
       Interpreter interp;
+      interp.set_constant_folding(false);
 
       std::istringstream iss(program);
     
@@ -242,6 +290,7 @@ TEST_CASE ( "Test apply invalid type of args", "[interpreter]") {
         std::cout << program << std::endl;
 
         Interpreter interp;
+        interp.set_constant_folding(false);
 
         std::istringstream iss(program);
     
@@ -255,4 +304,953 @@ TEST_CASE ( "Test apply invalid type of args", "[interpreter]") {
       }
     }
   }
-}
\ No newline at end of file
+}
+TEST_CASE ( "Test view tokenizer matches stream tokenizer", "[tokenize]" ) {
+
+  std::vector<std::string> programs = {
+    "(begin (define r 10) (* pi (* r r)))",
+    "; comment only",
+    "(+ 1 2) ; trailing comment\n(abc)",
+    "\t( a\r\nbb  )ccc",
+    ""
+  };
+
+  for (auto p : programs) {
+    std::istringstream iss(p);
+    TokenSequenceType expected = tokenize(iss);
+    TokenViewSequenceType views = tokenize_view(p);
+
+    REQUIRE(views.size() == expected.size());
+    for (std::size_t i = 0; i < views.size(); i++) {
+      REQUIRE(token_text(p, views[i]) == expected[i]);
+    }
+  }
+}
+
+TEST_CASE ( "Test Interpreter parse from buffer", "[interpreter]" ) {
+
+  std::string program = "(begin (define r 10) (* 2 (* r r)))";
+
+  Interpreter interp;
+  REQUIRE(interp.parse(std::string_view(program)) == true);
+  REQUIRE(interp.eval() == Expression(200.));
+
+  Interpreter bad;
+  REQUIRE(bad.parse(std::string_view("(+ 1")) == false);
+}
+
+TEST_CASE ( "Test loading a program file", "[source]" ) {
+
+  {
+    SourceFile source;
+    REQUIRE(source.load(TEST_FILE_DIR + "/test3.slp") == true);
+    REQUIRE(source.mapped() == true);
+
+    Interpreter interp;
+    REQUIRE(interp.parse(source.text()) == true);
+    REQUIRE(interp.eval() == Expression(2.));
+  }
+
+  { // empty files cannot be mapped, fall back to an empty buffer
+    SourceFile source;
+    REQUIRE(source.load(TEST_FILE_DIR + "/test0.slp") == true);
+    REQUIRE(source.text().empty());
+  }
+
+  {
+    SourceFile source;
+    REQUIRE(source.load(TEST_FILE_DIR + "/there/is/no/such/file") == false);
+    REQUIRE(source.text().empty());
+  }
+}
+
+TEST_CASE ( "Test delimiter scanners agree with the scalar scanner", "[tokenize]" ) {
+
+  // atoms and comments that straddle the 16 and 32 byte vector steps
+  std::vector<std::string> programs = {
+    "(" + std::string(15, 'a') + " " + std::string(33, 'b') + ")",
+    std::string(31, 'x') + ";" + std::string(70, 'c') + "\n(" + std::string(64, 'y') + ")",
+    "(begin\t(define r 10)\r\n(* pi (* r r)))",
+    "; comment without newline " + std::string(40, 'z'),
+    std::string(100, 'q')
+  };
+  std::vector<ScanMode> modes = {ScanAuto, ScanSSE2, ScanAVX2};
+
+  for (auto p : programs) {
+    TokenViewSequenceType expected = tokenize_view(p, ScanScalar);
+    for (auto m : modes) {
+      if (!scan_mode_supported(m)) continue;
+      TokenViewSequenceType tokens = tokenize_view(p, m);
+      REQUIRE(tokens.size() == expected.size());
+      for (std::size_t i = 0; i < tokens.size(); i++) {
+        REQUIRE(tokens[i].offset == expected[i].offset);
+        REQUIRE(tokens[i].length == expected[i].length);
+      }
+    }
+  }
+}
+
+TEST_CASE ( "Test number and symbol classification edge cases", "[types]" ) {
+
+  Atom atom;
+
+  std::vector<std::pair<std::string, double>> numbers = {
+    {"1.", 1.}, {".5", .5}, {"+.5", .5}, {"1E5", 1e5}, {"-0x10", -16.},
+    {"0x1.8p1", 3.}, {"-inf", -HUGE_VAL}, {"\v7", 7.}
+  };
+  for (auto p : numbers) {
+    REQUIRE(token_to_atom(p.first, atom) == true);
+    REQUIRE(is_number(atom.type));
+    REQUIRE(atom.number() == p.second);
+  }
+
+  // +inf is HUGE_VAL and was never accepted as a number
+  std::vector<std::string> symbols = {"inf", "+inf", "infinity", "+1e999", "-", ".", "a(b"};
+  for (auto s : symbols) {
+    REQUIRE(token_to_atom(s, atom) == true);
+    REQUIRE(atom.type == SymbolType);
+  }
+
+  std::vector<std::string> invalid = {"", "1abc", "1e999", "-1e999", "1e-400", "1\v", "a\vb", "0x"};
+  for (auto s : invalid) {
+    REQUIRE(token_to_atom(s, atom) == false);
+  }
+
+  REQUIRE(token_to_atom("nan", atom) == true);
+  REQUIRE(atom.type == RealType);
+  REQUIRE(std::isnan(atom.value.real_value));
+}
+
+TEST_CASE ( "Test symbol interning", "[types]" ) {
+
+  Symbol a("interned-name");
+  Symbol b(std::string("interned-name"));
+  Symbol c("other-name");
+
+  REQUIRE(a == b);
+  REQUIRE(a.index() == b.index());
+  REQUIRE(a != c);
+  REQUIRE(a.name() == "interned-name");
+  REQUIRE(Symbol().name().empty());
+
+  Atom atom;
+  REQUIRE(token_to_atom("interned-name", atom));
+  REQUIRE(atom.type == SymbolType);
+  REQUIRE(atom.value.sym_value.index() == a.index());
+
+  std::ostringstream out;
+  out << Expression(c);
+  REQUIRE(out.str() == "(other-name)");
+}
+
+TEST_CASE ( "Test compact value layout", "[types]" ) {
+
+  // a one-byte type and an 8-byte Value, see Atom in expression.hpp
+  REQUIRE(sizeof(Value) == 8);
+  REQUIRE(sizeof(Atom) == 16);
+
+  Atom b(true), n(2.5);
+  REQUIRE(b.type == BooleanType);
+  REQUIRE(b.value.bool_value == true);
+  REQUIRE(n.type == RealType);
+  REQUIRE(n.value.real_value == 2.5);
+  REQUIRE(Atom().type == NoneType);
+}
+
+TEST_CASE ( "Test flat ast arena", "[ast]" ) {
+
+  Ast ast;
+  Node leaves[] = {{Atom(1.), 0, 0}, {Atom(2.), 0, 0}};
+  Ast::Index first = ast.append(leaves, 2);
+  Node root = {Atom(true), first, 2};
+  ast.append(&root, 1);
+
+  REQUIRE(ast.root() == 2);
+  REQUIRE(ast[ast.root()].count == 2);
+
+  Expression exp = ast.to_expression(ast.root());
+  REQUIRE(exp.head.type == BooleanType);
+  REQUIRE(exp.tail.size() == 2);
+  REQUIRE(exp.tail[1] == Expression(2.));
+
+  { // a value with a tail evaluates to itself
+    Interpreter interp;
+    REQUIRE(interp.parse(std::string_view("(1 2 (3 4))")) == true);
+    std::ostringstream out;
+    out << interp.eval();
+    REQUIRE(out.str() == "(1(2)(3(4)))");
+  }
+}
+
+TEST_CASE ( "Test parsing deeply nested programs", "[interpreter]" ) {
+
+  const int depth = 200000;
+  std::string program;
+  for (int i = 0; i < depth; i++) program += "(+ 1 ";
+  program += "1";
+
+  { // truncated
+    Interpreter interp;
+    REQUIRE(interp.parse(std::string_view(program)) == false);
+  }
+
+  program += std::string(depth, ')');
+  {
+    Interpreter interp;
+    REQUIRE(interp.parse(std::string_view(program)) == true);
+  }
+
+  { // unfolded, the VM compiles the whole depth at parse time and runs it
+    Interpreter vm(BytecodeEngine);
+    vm.set_constant_folding(false);
+    REQUIRE(vm.parse(std::string_view(program)) == true);
+    REQUIRE(vm.eval() == Expression(Number(std::int64_t(depth + 1))));
+  }
+}
+
+TEST_CASE ( "Test keyword opcode resolution", "[ast]" ) {
+
+  std::vector<std::pair<std::string, Opcode>> cases = {
+    {"begin", OpBegin}, {"define", OpDefine}, {"if", OpIf},
+    {"x", OpSymbol}, {"+", OpSymbol}, {"1", OpValue}, {"True", OpValue}
+  };
+  for (auto c : cases) {
+    Atom atom;
+    REQUIRE(token_to_atom(c.first, atom));
+    REQUIRE(opcode_of(atom) == c.second);
+  }
+}
+
+TEST_CASE ( "Test bytecode engine matches the tree walker", "[vm]" ) {
+
+  const Case cases[] = {
+    {"(begin (define r 10) (* pi (* r r)))", "(314.159)"},
+    {"(if (< 1 2) (+ 1 2 3) False)", "(6)"},
+    {"(if False 1 (if True (- 5) 0))", "(-5)"},
+    {"(begin (define a True) (define b a) (and a b))", "(True)"},
+    {"(begin)", "()"}, {"(1 2 (3 4))", "(1(2)(3(4)))"},
+    {"(begin (define l (1 2)) (l))", "(1(2))"},
+    {"(begin (define x 2) (x (define y 1)) (y))", "Error: unbound symbol"},
+    {"(begin +)", "(0)"}, {"(pi 1 2)", "(3.14159)"},
+    {"(if True 1 (define))", "(1)"}, {"(log10 1000)", "(3)"},
+    // errors
+    {"(@ none)", "Error: unbound symbol"},
+    {"(- 1 1 2)", "Error: incorrect sub, too many args"},
+    {"(define if 1)", "Error: incorrect define symbol"},
+    {"(define pi 3.14)", "Error: redefining pi"},
+    {"(define)", "Error: incorrect define"},
+    {"(define 1 2)", "Error: incorrect define symbol"},
+    {"(if 1 2 3)", "Error: incorrect cond type"}, {"(if True)", "Error: incorrect if"},
+    {"(begin (define a 1) (define a 2))", "Error: redefining a"},
+    {"(+ 1 True)", "Error: incorrect arg type"}, {"(not 1)", "Error: incorrect arg type"},
+  };
+
+  check_cases(cases);
+
+  { // state carries over between evaluations, like in the repl
+    Interpreter vm(BytecodeEngine);
+    REQUIRE(vm.parse(std::string_view("(define k 4)")));
+    REQUIRE(vm.eval() == Expression(4.));
+    REQUIRE(vm.parse(std::string_view("(* k k)")));
+    REQUIRE(vm.eval() == Expression(16.));
+  }
+}
+
+TEST_CASE ( "Test builtin calls do not allocate", "[interpreter]" ) {
+
+  std::string program = "(begin (+ 1 2 3 4 5 6 7 8) (< (* 2 3) (- 10 (/ 8 2)))"
+                        " (and (not False) (or False True)) (pow 2 (log10 100)))";
+
+  for (auto engine : {TreeEngine, BytecodeEngine}) {
+    // the program is all constants, folded it would call no builtins
+    Interpreter interp(engine);
+    interp.set_constant_folding(false);
+    REQUIRE(interp.parse(std::string_view(program)));
+    interp.eval(); // let the VM stacks grow once
+
+    std::size_t before = allocations;
+    Expression result = interp.eval();
+    std::size_t after = allocations;
+    REQUIRE(after == before);
+    REQUIRE(result == Expression(4.));
+  }
+
+  for (auto engine : {TreeEngine, BytecodeEngine}) {
+    // longer calls still work, the tree walker spills their arguments
+    Interpreter interp(engine);
+    interp.set_constant_folding(false);
+    REQUIRE(interp.parse(std::string_view("(+ 1 2 3 4 5 6 7 8 9 10)")));
+    REQUIRE(interp.eval() == Expression(55.));
+  }
+}
+
+TEST_CASE ( "Test reading bound values does not copy them", "[environment]" ) {
+
+  {
+    Environment env;
+    REQUIRE(env.find("unbound-symbol") == nullptr);
+    REQUIRE(env.define("x", Expression(1.)));
+    const EnvResult * x = env.find("x");
+    REQUIRE(x != nullptr);
+    for (int i = 0; i < 100; i++) {
+      env.define("y" + std::to_string(i), Expression(2.));
+    }
+    REQUIRE(env.find("x") == x);
+    REQUIRE(x->exp == Expression(1.));
+  }
+
+  std::string big = "(define big (1";
+  for (int i = 2; i <= 1000; i++) big += " " + std::to_string(i);
+  big += "))";
+
+  for (auto engine : {TreeEngine, BytecodeEngine}) {
+    Interpreter interp(engine);
+    REQUIRE(interp.parse(std::string_view(big)));
+    interp.eval();
+    REQUIRE(interp.parse(std::string_view("(if (< big 2) (+ big big) 0)")));
+    interp.eval();
+
+    std::size_t before = allocations;
+    Expression result = interp.eval();
+    std::size_t after = allocations;
+    REQUIRE(after == before);
+    REQUIRE(result == Expression(2.));
+  }
+
+  for (auto engine : {TreeEngine, BytecodeEngine}) {
+    // values read in a loop are released as it goes, so a run ten
+    // times longer than the last keeps no more memory than it did
+    Interpreter interp(engine);
+    run(interp, "(begin (define xs (1 2 3)) (define n 100) (define i 0) (define f (lambda (l) (begin l l))))");
+    REQUIRE(interp.parse(std::string_view(
+      "(begin (set! i 0) (set! n (* n 10)) (while (< i n) xs (f xs) (set! i (+ i 1))) i)")));
+    interp.eval();
+
+    std::size_t before = allocations - deallocations;
+    Expression result = interp.eval();
+    std::size_t after = allocations - deallocations;
+    REQUIRE(after == before);
+    REQUIRE(result == Expression(Number(std::int64_t(10000))));
+  }
+}
+
+TEST_CASE ( "Test symbol map growth and lookup", "[environment]" ) {
+
+  SymbolMap<int> map;
+  std::vector<Symbol> syms;
+  for (int i = 0; i < 20000; i++) syms.push_back(Symbol("map-key-" + std::to_string(i)));
+
+  const int * first = nullptr;
+  for (int i = 0; i < 20000; i++) {
+    auto res = map.insert(syms[i], i);
+    REQUIRE(res.second == true);
+    if (i == 0) first = res.first;
+    // everything inserted so far stays findable while the table grows
+    if (i % 997 == 0) {
+      for (int j = 0; j <= i; j++) {
+        REQUIRE(map.find(syms[j]) != nullptr);
+        REQUIRE(*map.find(syms[j]) == j);
+      }
+    }
+  }
+  REQUIRE(map.size() == 20000);
+  REQUIRE(map.find(syms[0]) == first);
+  REQUIRE(map.insert(syms[5], -1).second == false);
+  REQUIRE(*map.find(syms[5]) == 5);
+  REQUIRE(map.find(Symbol("map-key-missing")) == nullptr);
+
+  // a copy is independent, and its entries stay put as it grows
+  SymbolMap<int> copy(map);
+  const int * copied = copy.find(syms[19999]);
+  REQUIRE(copy.insert(Symbol("map-key-extra"), 1).second == true);
+  REQUIRE(copy.find(syms[19999]) == copied);
+  REQUIRE(map.find(Symbol("map-key-extra")) == nullptr);
+}
+
+TEST_CASE ( "Test builtins are shared and free to set up", "[environment]" ) {
+
+  Symbol plus("+");
+  std::size_t before = allocations;
+  const EnvResult * found;
+  {
+    Environment env;
+    found = env.find(plus);
+  }
+  std::size_t after = allocations;
+  REQUIRE(after == before);
+  REQUIRE(found != nullptr);
+  REQUIRE(found == Environment::find_builtin(plus));
+
+  Environment a, b;
+  REQUIRE(a.find("pi") == b.find("pi"));
+  REQUIRE(a.define("pi", Expression(3.)) == false);
+  REQUIRE(a.define("tau", Expression(6.28)) == true);
+  REQUIRE(b.find("tau") == nullptr);
+  REQUIRE(Environment::find_builtin("tau") == nullptr);
+}
+
+TEST_CASE ( "Test forking interpreters from a snapshot", "[environment]" ) {
+
+  Interpreter prelude;
+  REQUIRE(prelude.parse(std::string_view("(begin (define a 1) (define b (+ a 1)))")));
+  prelude.eval();
+  Environment::Snapshot base = prelude.snapshot();
+
+  std::size_t before = allocations;
+  {
+    Interpreter fork(base);
+  }
+  std::size_t after = allocations;
+  REQUIRE(after == before);
+
+  for (Engine engine : {TreeEngine, BytecodeEngine}) {
+    Interpreter x(base, engine), y(base, engine);
+    REQUIRE(x.parse(std::string_view("(begin (define c 10) (+ a b c))")));
+    REQUIRE(x.eval() == Expression(13.));
+    // y sees the prelude but not what x defined
+    REQUIRE(y.parse(std::string_view("(begin (define c 20) (+ a b c))")));
+    REQUIRE(y.eval() == Expression(23.));
+    // names from the snapshot cannot be redefined
+    REQUIRE(y.parse(std::string_view("(define a 5)")));
+    REQUIRE_THROWS_AS(y.eval(), const InterpreterSemanticError &);
+  }
+
+  // the prelude keeps its own definitions and can go on defining
+  REQUIRE(prelude.parse(std::string_view("(define c 3)")));
+  REQUIRE(prelude.eval() == Expression(3.));
+  Interpreter late(base);
+  REQUIRE(late.parse(std::string_view("(+ c 1)")));
+  REQUIRE_THROWS_AS(late.eval(), const InterpreterSemanticError &);
+
+  // repeated snapshots keep every definition reachable
+  Interpreter chain;
+  for (int i = 0; i < 40; i++) {
+    REQUIRE(chain.parse("(define v" + std::to_string(i) + " " + std::to_string(i) + ")"));
+    chain.eval();
+    Interpreter child(chain.snapshot());
+    REQUIRE(child.parse(std::string_view("(+ v0 v" + std::to_string(i) + ")")));
+    REQUIRE(child.eval() == Expression(double(i)));
+  }
+}
+
+TEST_CASE ( "Test define moves values into their binding", "[interpreter]" ) {
+
+  const std::size_t length = 1000;
+  std::string program = "(define big (1";
+  for (std::size_t i = 2; i <= length; i++) program += " " + std::to_string(i);
+  program += "))";
+  // one copy of the list's tail
+  const std::size_t tree_bytes = length * sizeof(Expression);
+
+  for (auto engine : {TreeEngine, BytecodeEngine}) {
+    Interpreter interp(engine);
+    REQUIRE(interp.parse(std::string_view(program)));
+
+    // the binding keeps one copy and the result is another, nothing
+    // else may copy the tree on the way
+    std::size_t before = allocated_bytes;
+    Expression result = interp.eval();
+    std::size_t after = allocated_bytes;
+    REQUIRE(after - before >= 2 * tree_bytes);
+    REQUIRE(after - before < 3 * tree_bytes);
+    REQUIRE(result.tail.size() == length - 1);
+
+    REQUIRE(interp.parse(std::string_view("(+ big 1)")));
+    REQUIRE(interp.eval() == Expression(2.));
+  }
+
+  { // printing borrows the tail instead of copying each element
+    Interpreter interp;
+    REQUIRE(interp.parse(std::string_view(program)));
+    Expression result = interp.eval();
+    std::ostringstream out;
+    out << result;
+    std::size_t before = allocated_bytes;
+    out.str("");
+    out << result;
+    std::size_t after = allocated_bytes;
+    REQUIRE(after - before < tree_bytes);
+  }
+}
+
+TEST_CASE ( "Test hash consing shares equal subtrees", "[ast]" ) {
+
+  { // equal blocks are stored once, different ones are not
+    Ast ast(true);
+    Node leaves[] = {{Atom(1.), 0, 0, OpValue}, {Atom(2.), 0, 0, OpValue}};
+    Node others[] = {{Atom(1.), 0, 0, OpValue}, {Atom(-2.), 0, 0, OpValue}};
+    Ast::Index a = ast.append(leaves, 2);
+    Ast::Index b = ast.append(leaves, 2);
+    Ast::Index c = ast.append(others, 2);
+    Ast::Index d = ast.append(leaves, 1);
+    REQUIRE(a == b);
+    REQUIRE(c != a);
+    REQUIRE(d != a);
+    REQUIRE(ast.size() == 5);
+
+    Ast plain;
+    REQUIRE(plain.append(leaves, 2) != plain.append(leaves, 2));
+  }
+
+  { // compacting keeps shared blocks shared
+    Ast ast(true);
+    Node leaves[] = {{Atom(1.), 0, 0, OpValue}, {Atom(2.), 0, 0, OpValue}};
+    Node dead[] = {{Atom(3.), 0, 0, OpValue}};
+    ast.append(dead, 1);
+    Ast::Index first = ast.append(leaves, 2);
+    Node pair[] = {{Atom(1.), first, 2, OpValue}, {Atom(2.), first, 2, OpValue}};
+    ast.set_root({Atom(), ast.append(pair, 2), 2, OpValue});
+    Expression before = ast.to_expression(ast.root());
+    ast.compact();
+    REQUIRE(ast.size() == 5);
+    const Node & root = ast[ast.root()];
+    REQUIRE(ast[root.first].first == ast[root.first + 1].first);
+    REQUIRE(ast.to_expression(ast.root()) == before);
+  }
+
+  // structural equality looks at the whole tail
+  Interpreter x, y;
+  REQUIRE(x.parse(std::string_view("(1 2 (3 4))")));
+  REQUIRE(y.parse(std::string_view("(1 2 (3 5))")));
+  REQUIRE(!(x.eval() == y.eval()));
+  REQUIRE(y.parse(std::string_view("(1 2 (3 4))")));
+  REQUIRE(x.eval() == y.eval());
+
+  std::string term = "(if (< (+ 1 2) (* 2 2)) (- 10 (/ 8 2)) (pow 2 3))";
+  std::string program = "(begin";
+  for (int i = 0; i < 100; i++) program += " (define v" + std::to_string(i) + " " + term + ")";
+  program += " (+ v0 v99))";
+
+  for (auto engine : {TreeEngine, BytecodeEngine}) {
+    Interpreter plain(engine), shared(engine);
+    shared.set_hash_consing(true);
+    REQUIRE(plain.parse(std::string_view(program)));
+    REQUIRE(shared.parse(std::string_view(program)));
+    REQUIRE(plain.eval() == Expression(12.));
+    REQUIRE(shared.eval() == Expression(12.));
+  }
+}
+
+TEST_CASE ( "Test constant folding", "[ast]" ) {
+
+  { // (+ 1 (* 2 pi)) folds to a single value
+    Ast ast;
+    Node inner[] = {{Atom(2.), 0, 0, OpValue}, {Atom(), 0, 0, OpSymbol}};
+    inner[1].head.type = SymbolType;
+    inner[1].head.value.sym_value = Symbol("pi");
+    Ast::Index first = ast.append(inner, 2);
+    Node outer[] = {{Atom(1.), 0, 0, OpValue}, {Atom(), first, 2, OpSymbol}};
+    outer[1].head.type = SymbolType;
+    outer[1].head.value.sym_value = Symbol("*");
+    first = ast.append(outer, 2);
+    Node root = {Atom(), first, 2, OpSymbol};
+    root.head.type = SymbolType;
+    root.head.value.sym_value = Symbol("+");
+
+    Node folded = fold_constants(ast, root);
+    REQUIRE(folded.op == OpValue);
+    REQUIRE(folded.count == 0);
+    REQUIRE(folded.head.value.real_value == 1. + 2. * std::atan2(0, -1));
+  }
+
+  { // (+ x (* 2 pi)) rewrites the root's tail, compacting drops the old one
+    Ast ast;
+    Node inner[] = {{Atom(2.), 0, 0, OpValue}, {Atom(), 0, 0, OpSymbol}};
+    inner[1].head.type = SymbolType;
+    inner[1].head.value.sym_value = Symbol("pi");
+    Ast::Index first = ast.append(inner, 2);
+    Node outer[] = {{Atom(), 0, 0, OpSymbol}, {Atom(), first, 2, OpSymbol}};
+    outer[0].head.type = SymbolType;
+    outer[0].head.value.sym_value = Symbol("x");
+    outer[1].head.type = SymbolType;
+    outer[1].head.value.sym_value = Symbol("*");
+    first = ast.append(outer, 2);
+    Node root = {Atom(), first, 2, OpSymbol};
+    root.head.type = SymbolType;
+    root.head.value.sym_value = Symbol("+");
+
+    ast.set_root(fold_constants(ast, root));
+    REQUIRE(ast.size() == 7);
+    Expression before = ast.to_expression(ast.root());
+    ast.compact();
+    REQUIRE(ast.size() == 3);
+    REQUIRE(ast.to_expression(ast.root()) == before);
+  }
+
+  // folding must not change what a program does or how it fails
+  const Case cases[] = {
+    {"(* pi (* 2 2))", "(12.5664)"}, {"(< 1 2)", "(True)"},
+    {"(if (< 1 2) (+ 1 2) (- 1))", "(3)"}, {"(if False 1 (* 3 3))", "(9)"},
+    {"(+ (1 2) 3)", "(4)"}, {"(1 (+ 1 2))", "(1(+(1)(2)))"},
+    {"(begin (define a (+ 1 2)) (* a a))", "(9)"},
+    {"(if True (1 (+ 2 3)) 0)", "(1(+(2)(3)))"}, {"(pi 1 2)", "(3.14159)"},
+    {"(begin +)", "(0)"}, {"(if (not False) pi 0)", "(3.14159)"},
+    {"(begin (define g 1) (g (+ 1 2)) (1 (+ 1 2)))", "(1(+(1)(2)))"},
+    // errors, raised at eval time as before
+    {"(+ 1 True)", "Error: incorrect arg type"}, {"(if 1 2 3)", "Error: incorrect cond type"},
+    {"(if True 1)", "Error: incorrect if"}, {"(define (+ 1 2) 3)", "Error: redefining +"},
+    {"(if (< 1 2) foo 1)", "Error: unbound symbol"},
+    {"(begin (define a 1) (+ 1 True) (define a 2))", "Error: incorrect arg type"},
+    {"(- 1 2 3)", "Error: incorrect sub, too many args"},
+    {"(if (+ 1 2) 1 2)", "Error: incorrect cond type"},
+    {"(if True (+ 1 False) 0)", "Error: incorrect arg type"},
+  };
+
+  check_cases(cases);
+
+  // and the same with hash consing, which folding must leave intact
+  for (auto engine : {TreeEngine, BytecodeEngine}) {
+    for (bool fold : {false, true}) {
+      for (const auto & c : cases) {
+        Interpreter interp(engine);
+        interp.set_constant_folding(fold);
+        interp.set_hash_consing(true);
+        INFO(c.program);
+        REQUIRE(run(interp, c.program) == c.expected);
+      }
+    }
+  }
+}
+
+TEST_CASE ( "Test and/or short-circuit", "[interpreter]" ) {
+
+  const Case cases[] = {
+    {"(and)", "(True)"}, {"(or)", "(False)"},
+    {"(and True (< 1 2))", "(True)"}, {"(or False (< 2 1))", "(False)"},
+    // arguments after the deciding one are not evaluated
+    {"(and False unbound-x)", "(False)"}, {"(or True (+ 1 True))", "(True)"},
+    {"(and (< 2 1) (not 1))", "(False)"}, {"(or (< 1 2) (define z 1))", "(True)"},
+    {"(begin (or True (define y 2)) (+ y 1))", "Error: unbound symbol"},
+    // evaluated arguments are still checked
+    {"(and True 1)", "Error: incorrect arg type"}, {"(or 1 True)", "Error: incorrect arg type"},
+    {"(and True unbound-x)", "Error: unbound symbol"},
+    // the result is the deciding boolean alone
+    {"(or (True 2))", "(True)"}, {"(begin (define t True) (and t (or False t)))", "(True)"},
+  };
+
+  check_cases(cases);
+}
+
+TEST_CASE ( "Test integer and double numbers", "[types]" ) {
+
+  Atom atom;
+  REQUIRE(token_to_atom("42", atom));
+  REQUIRE(atom.type == NumberType);
+  REQUIRE(atom.value.num_value == 42);
+  REQUIRE(token_to_atom("-9007199254740993", atom));
+  REQUIRE(atom.type == NumberType);
+  REQUIRE(atom.value.num_value == -9007199254740993);
+  for (auto s : {"42.", "4.2", "1e3", "0x10", "99999999999999999999", "nan"}) {
+    REQUIRE(token_to_atom(s, atom));
+    REQUIRE(atom.type == RealType);
+  }
+  REQUIRE(Number(1) == Number(1.));
+  REQUIRE(Number(2) != Number(2.5));
+
+  const Case cases[] = {
+    // integers stay exact past 2^53
+    {"(+ 9007199254740992 1)", "(9007199254740993)"},
+    {"(* 3037000499 3037000499)", "(9223372030926249001)"},
+    {"(- 9007199254740993 1)", "(9007199254740992)"},
+    {"(= 9007199254740993 9007199254740992)", "(False)"},
+    {"(< 9007199254740992 9007199254740993)", "(True)"},
+    // mixed operands and overflow become doubles
+    {"(+ 1 0.5)", "(1.5)"}, {"(* 2 2.5)", "(5)"}, {"(< 1 1.5)", "(True)"},
+    {"(= 2 2.)", "(True)"}, {"(* 9223372036854775807 2)", "(1.84467e+19)"},
+    {"(- -9223372036854775807 10)", "(-9.22337e+18)"},
+    {"(- -9223372036854775808)", "(9.22337e+18)"},
+    // some operations always produce doubles
+    {"(/ 7 2)", "(3.5)"}, {"(pow 2 10)", "(1024)"}, {"(log10 1000)", "(3)"},
+    {"(+)", "(0)"}, {"(*)", "(1)"},
+  };
+
+  check_cases(cases);
+
+  { // the result type says which one was computed
+    Interpreter interp;
+    interp.set_constant_folding(false);
+    REQUIRE(interp.parse(std::string_view("(/ 8 2)")));
+    REQUIRE(interp.eval().head.type == RealType);
+    REQUIRE(interp.parse(std::string_view("(- 8 2)")));
+    REQUIRE(interp.eval().head.type == NumberType);
+  }
+}
+
+TEST_CASE ( "Test lambda", "[interpreter]" ) {
+
+  const Case cases[] = {
+    {"(begin (define sq (lambda (x) (* x x))) (sq 7))", "(49)"},
+    {"(begin (define f (lambda (x y) (- x y))) (f 10 3))", "(7)"},
+    {"(lambda (x) x)", "(<lambda>)"},
+    // parameters shadow builtins and outer parameters
+    {"(begin (define f (lambda (pi) (* pi 2))) (f 3))", "(6)"},
+    {"(begin (define f (lambda (pow x) (pow x))) (f (lambda (y) (- 0 y)) 4))", "(-4)"},
+    {"(begin (define f (lambda (x) (lambda (x) (* x 10)))) (define g (f 1)) (g 2))", "(20)"},
+    // closures see the parameters of enclosing calls
+    {"(begin (define adder (lambda (n) (lambda (x) (+ x n)))) (define add5 (adder 5)) (add5 10))", "(15)"},
+    {"(begin (define k (lambda (a) (lambda (b) (lambda (c) (+ a (* b c)))))) (define k1 (k 1)) (define k2 (k1 2)) (k2 3))", "(7)"},
+    // higher-order calls and recursion through a global
+    {"(begin (define twice (lambda (f x) (f (f x)))) (define inc (lambda (x) (+ x 1))) (twice inc 5))", "(7)"},
+    {"(begin (define fact (lambda (n) (if (< n 2) 1 (* n (fact (- n 1)))))) (fact 10))", "(3628800)"},
+    {"(begin (define id (lambda (x) x)) (id (1 2)))", "(1(2))"},
+    {"(begin (define f (lambda (x) (and x (or False x)))) (f True))", "(True)"},
+    // (f) refers to f rather than calling it
+    {"(begin (define f (lambda (x) x)) (f))", "(<lambda>)"},
+    {"(begin (define f (lambda (x) x)) (f 1 2))", "Error: incorrect number of args"},
+    {"(begin (define f (lambda (x y) x)) (f 1))", "Error: incorrect number of args"},
+    {"(lambda (x x) x)", "Error: incorrect lambda parameters"},
+    {"(lambda (1) 1)", "Error: incorrect lambda parameters"},
+    {"(lambda (x) x x)", "Error: incorrect lambda"},
+    {"(begin (define f (lambda (x) (+ x y))) (f 1))", "Error: unbound symbol"},
+  };
+
+  check_cases(cases);
+
+  for (auto engine : {TreeEngine, BytecodeEngine}) {
+    // closures outlive the program that made them
+    Interpreter interp(engine);
+    run(interp, "(define make (lambda (n) (lambda (x) (* x n))))");
+    run(interp, "(define triple (make 3))");
+    REQUIRE(run(interp, "(triple 4)") == "(12)");
+
+    // and are called the same from forks on either engine
+    Environment::Snapshot base = interp.snapshot();
+    for (auto other : {TreeEngine, BytecodeEngine}) {
+      Interpreter fork(base, other);
+      REQUIRE(run(fork, "(triple 5)") == "(15)");
+      REQUIRE(run(fork, "(begin (define double (make 2)) (double (triple 1)))") == "(6)");
+    }
+  }
+}
+
+TEST_CASE ( "Test closures are freed once unreachable", "[interpreter]" ) {
+
+  for (auto engine : {TreeEngine, BytecodeEngine}) {
+    Interpreter interp(engine);
+    run(interp, "(begin (define i 0) (define make (lambda (n) (lambda (x) (+ x n)))) (define f (make 0)))");
+    // each iteration replaces f by a new closure and frame
+    REQUIRE(interp.parse(std::string_view(
+      "(begin (set! i 0) (while (< i 1000) (set! f (make i)) (set! i (+ i 1))) (f 1))")));
+    interp.eval(); // let the VM stacks grow once
+
+    std::size_t before = allocations - deallocations;
+    Expression result = interp.eval();
+    std::size_t after = allocations - deallocations;
+    REQUIRE(after == before);
+    REQUIRE(result == Expression(1000.));
+  }
+}
+
+// run body on a thread of its own with a native stack of stack_size
+// bytes. Elsewhere than POSIX the thread gets the platform's default.
+static void run_on_stack(std::size_t stack_size, std::function<void()> body){
+#if defined(__unix__) || defined(__APPLE__)
+  pthread_attr_t attr;
+  REQUIRE(pthread_attr_init(&attr) == 0);
+  REQUIRE(pthread_attr_setstacksize(&attr, stack_size) == 0);
+  pthread_t thread;
+  auto start = [](void * arg) -> void * {
+    (*static_cast<std::function<void()> *>(arg))();
+    return nullptr;
+  };
+  REQUIRE(pthread_create(&thread, &attr, start, &body) == 0);
+  pthread_attr_destroy(&attr);
+  REQUIRE(pthread_join(thread, nullptr) == 0);
+#else
+  (void)stack_size;
+  std::thread thread(body);
+  thread.join();
+#endif
+}
+
+TEST_CASE ( "Test tail calls run in constant stack", "[interpreter]" ) {
+
+  // the calls sit in tail position: an if branch, the last form of a
+  // begin, and the body of the lambda itself
+  const char * program =
+    "(begin"
+    "  (define count (lambda (n acc)"
+    "    (if (= n 0) acc (begin (< n 0) (count (- n 1) (+ acc 1))))))"
+    "  (define self (lambda (f n) (if (= n 0) (count %d 0) (f f (- n 1)))))"
+    "  (self self 100000))";
+
+  // The tree walker's calls used to nest on the native stack, so the
+  // program runs on a small stack of a known size: a thread's default
+  // is no fixed size either, glibc takes it from RLIMIT_STACK just as
+  // for the main thread. Without tail calls, a hundred thousand nested
+  // calls would overflow it many times over.
+  const std::size_t stack_size = 256 * 1024;
+  const struct { Engine engine; int iterations; } runs[] = {
+    {TreeEngine, 100000}, {BytecodeEngine, 100000},
+  };
+  for (const auto & run_case : runs) {
+    char source[512];
+    std::snprintf(source, sizeof(source), program, run_case.iterations);
+    std::string result;
+    run_on_stack(stack_size, [&]() {
+      try {
+        Interpreter interp(run_case.engine);
+        interp.parse(std::string_view(source));
+        std::ostringstream out;
+        out << interp.eval();
+        result = out.str();
+      } catch (const std::exception & e) {
+        result = e.what();
+      }
+    });
+    REQUIRE(result == "(" + std::to_string(run_case.iterations) + ")");
+  }
+}
+
+TEST_CASE ( "Test while and set!", "[interpreter]" ) {
+
+  const Case cases[] = {
+    {"(begin (define i 0) (define acc 0) (while (< i 10) (set! acc (+ acc i)) (set! i (+ i 1))) acc)", "(45)"},
+    {"(begin (define x 1) (set! x (+ x 1)))", "(2)"},
+    {"(while False 1)", "()"}, {"(while (< 2 1))", "()"},
+    // parameters are assigned in their frame, which closures share
+    {"(begin (define f (lambda (n acc) (begin (while (< 0 n) (set! acc (+ acc n)) (set! n (- n 1))) acc))) (f 4 0))", "(10)"},
+    {"(begin (define make (lambda (n) (lambda (d) (set! n (+ n d))))) (define c (make 10)) (c 1) (c 5))", "(16)"},
+    {"(begin (define x 1) (define f (lambda (x) (set! x 5))) (f 2) x)", "(1)"},
+    // values already taken keep the old list
+    {"(begin (define x (1 2)) (define y x) (set! x 3) y)", "(1(2))"},
+    {"(begin (define x (1 2)) (define f (lambda (a b) a)) (f x (set! x 3)))", "(1(2))"},
+    {"(begin (define x (1 2)) (set! x x))", "(1(2))"},
+    {"(while)", "Error: incorrect while"}, {"(while 1 2)", "Error: incorrect cond type"},
+    {"(set! x 1)", "Error: unbound symbol"}, {"(set! pi 3)", "Error: setting builtin pi"},
+    {"(set! 1 2)", "Error: incorrect set! symbol"}, {"(begin (define x 1) (set! x))", "Error: incorrect set!"},
+  };
+
+  check_cases(cases);
+
+  for (auto engine : {TreeEngine, BytecodeEngine}) {
+    // a numeric loop allocates nothing per iteration
+    Interpreter interp(engine);
+    run(interp, "(begin (define i 0) (define acc 0))");
+    REQUIRE(interp.parse(std::string_view(
+      "(begin (set! i 0) (set! acc 0) (while (< i 100000) (set! acc (+ acc i)) (set! i (+ i 1))) acc)")));
+    interp.eval(); // let the VM stacks grow once
+
+    std::size_t before = allocations;
+    Expression result = interp.eval();
+    std::size_t after = allocations;
+    REQUIRE(after == before);
+    REQUIRE(result == Expression(Number(std::int64_t(4999950000))));
+  }
+
+  for (auto engine : {TreeEngine, BytecodeEngine}) {
+    // assigning a snapshot's binding leaves the snapshot as it was
+    Interpreter base(engine);
+    run(base, "(define x 1)");
+    Environment::Snapshot snap = base.snapshot();
+    Interpreter a(snap, engine), b(snap, engine);
+    REQUIRE(run(a, "(set! x 2)") == "(2)");
+    REQUIRE(run(a, "(+ x 0)") == "(2)");
+    REQUIRE(run(b, "(+ x 0)") == "(1)");
+    REQUIRE(run(base, "(set! x 3)") == "(3)");
+    REQUIRE(run(b, "(+ x 0)") == "(1)");
+
+    // the newest value survives snapshots being merged
+    for (int i = 0; i < 20; i++) {
+      run(base, "(set! x " + std::to_string(i) + ")");
+      base.snapshot();
+    }
+    REQUIRE(run(base, "(+ x 0)") == "(19)");
+    Interpreter fork(base.snapshot(), engine);
+    REQUIRE(run(fork, "(+ x 0)") == "(19)");
+  }
+
+  for (auto engine : {TreeEngine, BytecodeEngine}) {
+    // so does assigning a parameter that a snapshot's closure captured
+    Interpreter base(engine);
+    run(base, "(begin (define make (lambda (n) (lambda (d) (set! n (+ n d))))) (define counter (make 10)))");
+    Environment::Snapshot snap = base.snapshot();
+    Interpreter a(snap, engine), b(snap, engine);
+    REQUIRE(run(a, "(counter 1)") == "(11)");
+    REQUIRE(run(a, "(counter 1)") == "(12)");
+    REQUIRE(run(b, "(counter 1)") == "(11)");
+    REQUIRE(run(base, "(counter 1)") == "(11)");
+
+    // a fork's snapshot carries its own count on, through merged layers too
+    Interpreter c(a.snapshot(), engine);
+    REQUIRE(run(c, "(counter 1)") == "(13)");
+    REQUIRE(run(a, "(counter 1)") == "(13)");
+    for (int i = 0; i < 10; i++) {
+      run(c, "(counter 0)");
+      c.snapshot();
+    }
+    REQUIRE(run(c, "(counter 1)") == "(14)");
+    REQUIRE(run(b, "(counter 1)") == "(12)");
+    REQUIRE(run(base, "(counter 1)") == "(12)");
+  }
+}
+
+TEST_CASE ( "Test inline caches for global symbols", "[environment]" ) {
+
+  { // epochs change only when a bound symbol could resolve differently
+    Environment env, other;
+    REQUIRE(env.epoch() != other.epoch());
+    std::uint64_t epoch = env.epoch();
+    REQUIRE(env.define(Symbol("cache-x"), Expression(1.)));
+    REQUIRE(env.epoch() == epoch);
+    REQUIRE(env.assignable(Symbol("cache-x")));
+    REQUIRE(env.epoch() == epoch);
+
+    BindingCache cache;
+    const EnvResult * x = env.find(Symbol("cache-x"), &cache);
+    REQUIRE(x == env.find(Symbol("cache-x")));
+    REQUIRE(cache.epoch == epoch);
+    REQUIRE(env.find(Symbol("cache-x"), &cache) == x);
+
+    Environment::Snapshot snap = env.snapshot();
+    REQUIRE(env.epoch() != epoch);
+    Environment fork(snap);
+    epoch = fork.epoch();
+    REQUIRE(fork.assignable(Symbol("cache-x")));
+    REQUIRE(fork.epoch() != epoch);
+    REQUIRE(fork.find(Symbol("cache-x"), &cache) != x);
+  }
+
+  for (auto engine : {TreeEngine, BytecodeEngine}) {
+    // an assignment that shadows a snapshot's binding is seen at once
+    Interpreter base(engine);
+    run(base, "(begin (define x 10) (define i 0) (define get (lambda (d) (+ x d))))");
+    Interpreter fork(base.snapshot(), engine);
+    REQUIRE(run(fork, "(begin (while (< i 3) (set! x (+ x 1)) (set! i (+ i 1))) (+ x 0))") == "(13)");
+    REQUIRE(run(fork, "(get 0)") == "(13)");
+    REQUIRE(run(base, "(get 0)") == "(10)");
+
+    // forks calling a closure of the program they share, each on a
+    // thread of its own, fill caches of their own
+    Environment::Snapshot snap = base.snapshot();
+    Interpreter forks[] = {Interpreter(snap, engine), Interpreter(snap, engine)};
+    std::string results[2];
+    std::thread threads[2];
+    for (int f = 0; f < 2; f++) {
+      run(forks[f], "(begin (set! x " + std::to_string(f + 1) + ") (define s 0))");
+      REQUIRE(forks[f].parse(std::string_view(
+        "(begin (set! i 0) (while (< i 1000) (set! s (+ s (get 0))) (set! i (+ i 1))) s)")));
+      threads[f] = std::thread([&forks, &results, f]() {
+        std::ostringstream out;
+        out << forks[f].eval();
+        results[f] = out.str();
+      });
+    }
+    for (std::thread & thread : threads) thread.join();
+    REQUIRE(results[0] == "(1000)");
+    REQUIRE(results[1] == "(2000)");
+    REQUIRE(run(base, "(get 0)") == "(10)");
+
+    // a closure's cached binding survives its layer being flattened
+    Interpreter deep(engine);
+    for (int i = 0; i < 8; i++) {
+      run(deep, "(define layer" + std::to_string(i) + " " + std::to_string(i) + ")");
+      deep.snapshot();
+    }
+    run(deep, "(begin (define y 5) (define get-y (lambda (d) (+ y d))))");
+    REQUIRE(run(deep, "(get-y 1)") == "(6)");
+    deep.snapshot();
+    REQUIRE(run(deep, "(get-y 2)") == "(7)");
+    REQUIRE(run(deep, "(begin (set! y 6) (get-y 2))") == "(8)");
+  }
+}
@@ -0,0 +1,280 @@
+#include "vm.hpp"
+
+// system includes
+#include <utility>
+
+// module includes
+#include "interpreter_semantic_error.hpp"
+
+// The VM dispatches through a switch. With GCC or Clang, define
+// VM_THREADED_DISPATCH to run direct-threaded code instead: a chunk is
+// linked once, the first time a VM runs it, storing the address of each
+// instruction's handler in the instruction, and each handler jumps
+// straight to the next one's. Compare the two with perf_dispatch.sh
+// before making it the default.
+#if defined(VM_THREADED_DISPATCH) && !defined(__GNUC__) && !defined(__clang__)
+#undef VM_THREADED_DISPATCH
+#endif
+#ifdef VM_THREADED_DISPATCH
+#define HANDLER(op) case op: op##_handler:
+#define NEXT() do { in = &code[pc++]; goto *in->handler; } while (0)
+#define CHUNK(program) (&(program)->linked_chunk(handlers))
+#else
+#define HANDLER(op) case op:
+#define NEXT() continue
+#define CHUNK(program) (&(program)->chunk())
+#endif
+
+Expression VM::run(const std::shared_ptr<const Program> & program, Environment & env){
+  stack.clear();
+  borrowed.clear();
+  callees.clear();
+  lists.clear();
+  returns.clear();
+
+  // push a value without a tail
+  auto push = [&](auto && atom) {
+    stack.push_back(std::forward<decltype(atom)>(atom));
+    borrowed.push_back(0);
+  };
+  // the operand at position i
+  auto to_expression = [&](std::size_t i) -> Expression {
+    if (borrowed[i]) return *lists[borrowed[i] - 1];
+    return Expression(stack[i]);
+  };
+  // push exp, borrowing its tail while owner keeps it alive
+  auto push_expression = [&](const Expression & exp, const std::shared_ptr<const void> & owner) {
+    if (exp.tail.empty()) {
+      push(exp.head);
+    } else {
+      lists.emplace_back(owner, &exp);
+      stack.push_back(exp.head);
+      borrowed.push_back(static_cast<std::uint32_t>(lists.size()));
+    }
+  };
+  // pop the operands from base up. Operands higher on the stack borrow
+  // later lists, so the first one that borrows gives the new size.
+  auto pop_to = [&](std::size_t base) {
+    for (std::size_t i = base; !lists.empty() && i < borrowed.size(); i++) {
+      if (borrowed[i]) {
+        lists.resize(borrowed[i] - 1);
+        break;
+      }
+    }
+    stack.resize(base);
+    borrowed.resize(base);
+  };
+
+  // assign the top value to target, a binding that other operands may
+  // still borrow the old value of
+  auto assign = [&](Expression & target) {
+    if (!target.tail.empty()) {
+      std::shared_ptr<const Expression> old;
+      for (std::shared_ptr<const Expression> & list : lists) {
+        if (list.get() != &target) continue;
+        if (!old) old = std::make_shared<const Expression>(std::move(target));
+        list = old;
+      }
+    }
+    target = to_expression(stack.size() - 1);
+  };
+
+#ifdef VM_THREADED_DISPATCH
+  // one entry per VmOp, in order, to link chunks with
+  static const void * const handlers[] = {
+    &&VmPush_handler, &&VmPushList_handler, &&VmLookup_handler, &&VmLocal_handler,
+    &&VmCall_handler, &&VmTailCall_handler, &&VmClosure_handler, &&VmReturn_handler,
+    &&VmDefine_handler, &&VmSet_handler, &&VmSetLocal_handler, &&VmJumpIfFalse_handler,
+    &&VmJumpIfEqual_handler, &&VmJump_handler, &&VmPop_handler, &&VmThrow_handler,
+    &&VmHalt_handler,
+  };
+  static_assert(sizeof(handlers) / sizeof(handlers[0]) == VmHalt + 1, "a VmOp has no handler");
+#endif
+
+  // the program being run and the frame of the closure call, if any
+  std::shared_ptr<const Program> current = program;
+  std::shared_ptr<Frame> frame;
+  const Chunk * chunk = CHUNK(current);
+  const Instr * code = chunk->code.data();
+  BindingCache * caches = symbol_caches.of(current, chunk->symbols.size());
+  std::size_t pc = 0;
+  const Instr * in;
+
+  // Calls do their work in these, so the handlers keep no locals with
+  // destructors: a computed goto out of a scope does not run them.
+
+  // call a builtin with the top argc operands, which it reads in place
+  auto apply = [&](Procedure proc, std::uint32_t argc) {
+    std::size_t base = stack.size() - argc;
+    Atom result = proc(Args(stack.data() + base, argc));
+    pop_to(base);
+    push(std::move(result));
+  };
+
+  // start running a closure with the top argc operands as its arguments
+  auto enter = [&](const Closure & closure, VmOp op, std::uint32_t argc) {
+    if (argc != closure.arity) throw InterpreterSemanticError("incorrect number of args");
+    // a tail call leaves nothing to return to, so loops written as
+    // tail recursion run in constant space. The caller's frame is
+    // reused unless a closure captured it.
+    std::shared_ptr<Frame> callee_frame;
+    if (op == VmTailCall && frame.use_count() == 1) {
+      callee_frame = std::move(frame);
+    } else {
+      callee_frame = std::make_shared<Frame>();
+    }
+    if (callee_frame->parent != closure.frame) callee_frame->parent = closure.frame;
+    callee_frame->slots.resize(argc);
+    std::size_t base = stack.size() - argc;
+    for (std::size_t i = 0; i < argc; i++) {
+      callee_frame->slots[i] = to_expression(base + i);
+    }
+    pop_to(base);
+    if (op == VmCall) returns.push_back({current, pc, std::move(frame)});
+    frame = std::move(callee_frame);
+    if (current != closure.program) {
+      current = closure.program;
+      chunk = CHUNK(current);
+      code = chunk->code.data();
+      caches = symbol_caches.of(current, chunk->symbols.size());
+    }
+    pc = chunk->entries.at(closure.lambda);
+  };
+  // the switch dispatches the first instruction, and every one after
+  // it when handlers do not jump to each other
+  for (;;) {
+    in = &code[pc++];
+    switch (in->op)
+    {
+    HANDLER(VmPush)
+      push(chunk->constants[in->a]);
+      NEXT();
+
+    HANDLER(VmPushList)
+      push_expression(chunk->lists[in->a], nullptr);
+      NEXT();
+
+    HANDLER(VmLookup) {
+      const EnvResult * envres = env.find(chunk->symbols[in->a], &caches[in->a]);
+      if (!envres) throw InterpreterSemanticError("unbound symbol");
+      if (envres->type == ProcedureType) {
+        callees.push_back({envres->proc, Atom()});
+      } else if (envres->exp.head.type == LambdaType) {
+        callees.push_back({nullptr, envres->exp.head});
+      } else {
+        push_expression(envres->exp, nullptr);
+        pc = in->b;
+      }
+      NEXT();
+    }
+
+    HANDLER(VmLocal) {
+      const Expression & value = env.local(frame.get(), in->a >> 16, in->a & 0xFFFF);
+      if (value.head.type == LambdaType) {
+        callees.push_back({nullptr, value.head});
+        NEXT();
+      }
+      if (!value.tail.empty()) {
+        // the frame keeps value and the frames it is in alive, and
+        // cannot be reused by a tail call while value is borrowed
+        push_expression(value, frame);
+      } else {
+        push(value.head);
+      }
+      pc = in->b;
+      NEXT();
+    }
+
+    HANDLER(VmCall)
+    HANDLER(VmTailCall) {
+      Callee & callee = callees.back();
+      if (callee.proc) {
+        apply(callee.proc, in->a);
+      } else if (in->a == 0) {
+        // (f) is f itself, as for any other binding
+        push(std::move(callee.closure));
+      } else {
+        enter(*callee.closure.value.closure_value, in->op, in->a);
+      }
+      callees.pop_back();
+      NEXT();
+    }
+
+    HANDLER(VmClosure) {
+      push(make_closure(current, in->a, in->b, frame));
+      NEXT();
+    }
+
+    HANDLER(VmReturn) {
+      Return & ret = returns.back();
+      frame = std::move(ret.frame);
+      pc = ret.pc;
+      if (ret.program != current) {
+        current = std::move(ret.program);
+        chunk = CHUNK(current);
+        code = chunk->code.data();
+        caches = symbol_caches.of(current, chunk->symbols.size());
+      }
+      returns.pop_back();
+      NEXT();
+    }
+
+    HANDLER(VmDefine) {
+      const Symbol & sym = chunk->symbols[in->a];
+      if (!env.define(sym, to_expression(stack.size() - 1))) {
+        throw InterpreterSemanticError("redefining " + sym.name());
+      }
+      NEXT();
+    }
+
+    HANDLER(VmSet) {
+      const Symbol & sym = chunk->symbols[in->a];
+      if (Environment::find_builtin(sym)) throw InterpreterSemanticError("setting builtin " + sym.name());
+      Expression * target = env.assignable(sym);
+      if (!target) throw InterpreterSemanticError("unbound symbol");
+      assign(*target);
+      NEXT();
+    }
+
+    HANDLER(VmSetLocal)
+      assign(env.assignable_local(frame.get(), in->a >> 16, in->a & 0xFFFF));
+      NEXT();
+
+    HANDLER(VmJumpIfFalse) {
+      const Atom & cond = stack.back();
+      if (cond.type != BooleanType) throw InterpreterSemanticError("incorrect cond type");
+      if (!cond.value.bool_value) pc = in->a;
+      pop_to(stack.size() - 1);
+      NEXT();
+    }
+
+    HANDLER(VmJumpIfEqual) {
+      const Atom & arg = stack.back();
+      if (arg.type != BooleanType) throw InterpreterSemanticError("incorrect arg type");
+      if (arg.value.bool_value == static_cast<Boolean>(in->b)) {
+        // the result is the boolean, not its tail
+        if (borrowed.back()) lists.resize(borrowed.back() - 1);
+        borrowed.back() = 0;
+        pc = in->a;
+      } else {
+        pop_to(stack.size() - 1);
+      }
+      NEXT();
+    }
+
+    HANDLER(VmJump)
+      pc = in->a;
+      NEXT();
+
+    HANDLER(VmPop)
+      pop_to(stack.size() - 1);
+      NEXT();
+
+    HANDLER(VmThrow)
+      throw InterpreterSemanticError(chunk->errors[in->a]);
+
+    HANDLER(VmHalt)
+      return to_expression(stack.size() - 1);
+    }
+  }
+}
@@ -0,0 +1,55 @@
+#ifndef VM_HPP
+#define VM_HPP
+
+// system includes
+#include <memory>
+#include <vector>
+
+// module includes
+#include "bytecode.hpp"
+#include "environment.hpp"
+#include "expression.hpp"
+#include "program.hpp"
+
+// VM runs compiled bytecode on an operand stack against an Environment.
+// It gives the same results and raises the same InterpreterSemanticErrors
+// as Interpreter's tree walker. The stacks are kept between runs so a
+// long-lived VM stops allocating once they have grown.
+class VM{
+public:
+  Expression run(const std::shared_ptr<const Program> & program, Environment & env);
+
+private:
+  // what VmCall applies, a builtin or a LambdaType Atom, which keeps
+  // the closure alive while its arguments are evaluated
+  struct Callee{
+    Procedure proc;
+    Atom closure;
+  };
+
+  // where a closure call returns to
+  struct Return{
+    std::shared_ptr<const Program> program;
+    std::size_t pc;
+    std::shared_ptr<Frame> frame;
+  };
+
+  // The operands, kept contiguous so a builtin reads its arguments
+  // where they are. Values with a tail are borrowed from the chunk or
+  // from their binding: the atom is their head and borrowed, at the same
+  // position, a 1-based index into lists. Borrowed lists are released as
+  // their operands are popped, so lists never holds more than the stack
+  // does.
+  std::vector<Atom> stack;
+  std::vector<std::uint32_t> borrowed;
+  std::vector<Callee> callees;
+  // each points at a borrowed list and shares ownership of whatever
+  // keeps it alive, if that is not the chunk or a global binding: the
+  // frame it was read from, or the old value of an assigned binding
+  std::vector<std::shared_ptr<const Expression>> lists;
+  std::vector<Return> returns;
+  // the inline caches of the symbols of each program run
+  BindingCaches symbol_caches;
+};
+
+#endif